@@ -13,8 +13,21 @@ date: 2016-1-7
 #include <asynDriver.h>
 #include <asynPortDriver.h>
 #include <epicsExport.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
 #include <iostream>
+#include <vector>
 #include <fps3010.h>
+#include <fpsTypes.h>
+#include <fpsHistory.h>
+#include <fpsAllan.h>
+#include <fpsMerge.h>
+#include <fpsParamBatch.h>
+#include <fpsExposure.h>
+#include <fpsStreamServer.h>
+#include <fpsDrift.h>
 
 using namespace std;
 int fpsDebug;
@@ -24,17 +37,48 @@ void fpsStatePrint(int status);
 
 static const char* driverName = "blcfpszzhDriver";
 
+#define FPS_MAX_DEVICES			8
+#define FPS_DEFAULT_LBSMPTIME	5			//327.68us, fine enough for the 1 ms history level
+#define FPS_DEFAULT_HISTORY		3600		//seconds of history kept per level
+#define FPS_HIST_POINTS			2000		//NELM of the history waveforms
+#define FPS_ALLAN_MAXTAU		14400		//longest Allan tau (s)
+#define FPS_DEFAULT_PUBRATE		10			//parameter publication rate (Hz)
+#define FPS_MIN_PUBRATE			0.1
+#define FPS_MAX_PUBRATE			100
+#define FPS_EXP_FRAMES			1000		//frame records kept, NELM of the exposure waveforms
+#define FPS_DRIFT_TICK			0.1			//ECU update period (s)
+#define FPS_DRIFT_MAXLAG		3600		//longest ECU lag of the drift model (s)
+#define FPS_DRIFT_WINDOW		3600		//default forgetting time of the drift model (s)
+
+class blcfps;
+
+//drivers by device number, the position callback only knows the devNo
+
+static blcfps* fpsDevices[FPS_MAX_DEVICES];
+
+static void fpsPositionCallback( unsigned int devNo, unsigned int length, unsigned int index,
+								 const double * const positions[3], const bln32 * const markers[3] );
+static void pubTaskC(void *drvPvt);
+static void driftTaskC(void *drvPvt);
+
 
 
 class blcfps : public asynPortDriver 
 {
 	
 public:
-	blcfps(const char* portName, int devNo);
+	blcfps(const char* portName, int devNo, int lbSmpTime, double historySeconds);
 	~blcfps();
 	virtual asynStatus readInt32(asynUser *pasynUser, epicsInt32 *value);
 	virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus readFloat64(asynUser *pasynUser, epicsFloat64 *value);
+	virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+	virtual asynStatus readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn);
+	void processPositions(unsigned int length, unsigned int index,
+						  const double * const positions[3], const bln32 * const markers[3]);
+	void pubTask();
+	void driftTask();
+	bool startStreamServer(const char *bindAddr, int tcpPort, int policy, int queueFrames);
 
 protected:
 	int adjust1;
@@ -43,8 +87,65 @@ protected:
 	int axisSignalWeak4;
 	int getPosition5;
 	int reset6;
+	int histLevel7;
+	int histStart8;
+	int histSpan9;
+	int histQuery10;
+	int histPeriod11;
+	int histMin12;
+	int histMax13;
+	int histMean14;
+	int histTime15;
+	int allanReset16;
+	int allanTau17;
+	int allanDev18;
+	int driftRate19;
+	int pubRate20;
+	int pubFlush21;
+	int pubDeadband22;
+	int pubStaged23;
+	int pubCallbacks24;
+	int pubSuppressed25;
+	int pubRatio26;
+	int streamPos27;
+	int streamLost28;
+	int expMarker29;
+	int expReset30;
+	int expFrame31;
+	int expFrames32;
+	int expStart33;
+	int expSamples34;
+	int expLost35;
+	int expMean36;
+	int expStd37;
+	int expMin38;
+	int expMax39;
+	int streamClients40;
+	int streamClientRate41;
+	int streamClientFrames42;
+	int streamClientDropped43;
+	int streamClientGaps44;
+	int streamClientDecim45;
+	int driftEnable46;
+	int driftPressure47;
+	int driftReset48;
+	int driftLag49;
+	int driftWindow50;
+	int driftOffset51;
+	int driftTempCoef52;
+	int driftPressCoef53;
+	int driftPredict54;
+	int driftResidual55;
+	int ecuTemp56;
+	int ecuPress57;
+	int ecuHumid58;
 
 private:
+	void queryHistory();
+	void publishExposures();
+	void publishStreamClients();
+	void setDriftModel();
+
 	FPS_InterfaceType type;
 	unsigned int devNum;
 	unsigned int devNo;
@@ -53,22 +154,82 @@ private:
 	bln32  valid;
 	bln32  error;
 	double position;
+
+	//position stream, filled by the library thread under dataLock only.
+	//The callback must never take the driver lock: the library may be
+	//waiting for its own thread inside an FPS_ call made by the port thread.
+
+	epicsMutex dataLock;
+	double samplePeriod;
+	bool markerEnabled;
+	bool streamStarted;
+	unsigned int nextIndex;
+	fpsUInt64 sampleCount;
+	fpsUInt64 lostSamples;
+	double lastValue[3];
+	fpsHistory history;
+	fpsAllan allan;
+	fpsExposure exposure;
+	int expMarker;						//marker input that gates the exposure, -1 for any
+
+	//result of the last history query, per axis
+	
+	size_t histPoints[3];
+	std::vector<double> histMinBuf[3];
+	std::vector<double> histMaxBuf[3];
+	std::vector<double> histMeanBuf[3];
+	std::vector<double> histTimeBuf[3];
+
+	//parameter changes wait here for the publication task
+	
+	fpsParamBatch batch;
+	epicsEvent pubEvent;
+
+	//exposure records copied out for publication
+
+	epicsUInt32 expPublished;
+	bool expCleared;					//reset since the last publication
+	std::vector<fpsExposureRecord> expRecords;
+	std::vector<double> expBuf;
+
+	//optional TCP stream of the raw packets
+
+	fpsStreamServer *streamServer;
+	epicsTimeStamp streamStatTime;
+	fpsUInt64 streamBytes[FPS_STREAM_CLIENTS];
+
+	//thermal drift model, the stream is averaged over every ECU tick
+
+	fpsDrift drift;
+	double driftSum[3];
+	unsigned int driftCount;
 	
 };
 
 //the class constructor function
 
-blcfps::blcfps(const char* portName, int devNo_):
+blcfps::blcfps(const char* portName, int devNo_, int lbSmpTime, double historySeconds):
 	asynPortDriver(portName,				//port name 
 		3,									//max addrs
-		6, 									//max params
-		asynFloat64Mask | asynInt32Mask | asynOctetMask | asynDrvUserMask,	//interfaces to be implement
-		0,													//interrupt
+		58, 								//max params
+		asynFloat64Mask | asynInt32Mask | asynOctetMask | asynFloat64ArrayMask | asynDrvUserMask,	//interfaces to be implement
+		asynFloat64Mask | asynInt32Mask | asynFloat64ArrayMask,	//interrupt
 		ASYN_MULTIDEVICE | ASYN_CANBLOCK, 					//if multidevice and if canblock
 		1, 						//autoconnect
 		0,						//default priority
 		0),						//default stack size
-	type(IfUsb)					//initiate
+	type(IfUsb),				//initiate
+	markerEnabled(false),
+	streamStarted(false),
+	nextIndex(0),
+	sampleCount(0),
+	lostSamples(0),
+	expMarker(0),
+	batch(this, 3),
+	expPublished(0),
+	expCleared(false),
+	streamServer(0),
+	driftCount(0)
 {
 	
 	devNo = devNo_;
@@ -125,8 +286,441 @@ blcfps::blcfps(const char* portName, int devNo_):
 	createParam("axisSignalWeak", asynParamInt32, &axisSignalWeak4);
 	createParam("getPosition", asynParamFloat64, &getPosition5);
 	createParam("reset", asynParamInt32, &reset6);
+	createParam("histLevel", asynParamInt32, &histLevel7);
+	createParam("histStart", asynParamFloat64, &histStart8);
+	createParam("histSpan", asynParamFloat64, &histSpan9);
+	createParam("histQuery", asynParamInt32, &histQuery10);
+	createParam("histPeriod", asynParamFloat64, &histPeriod11);
+	createParam("histMin", asynParamFloat64Array, &histMin12);
+	createParam("histMax", asynParamFloat64Array, &histMax13);
+	createParam("histMean", asynParamFloat64Array, &histMean14);
+	createParam("histTime", asynParamFloat64Array, &histTime15);
+	createParam("allanReset", asynParamInt32, &allanReset16);
+	createParam("allanTau", asynParamFloat64Array, &allanTau17);
+	createParam("allanDev", asynParamFloat64Array, &allanDev18);
+	createParam("driftRate", asynParamFloat64, &driftRate19);
+	createParam("pubRate", asynParamFloat64, &pubRate20);
+	createParam("pubFlush", asynParamInt32, &pubFlush21);
+	createParam("pubDeadband", asynParamFloat64, &pubDeadband22);
+	createParam("pubStaged", asynParamInt32, &pubStaged23);
+	createParam("pubCallbacks", asynParamInt32, &pubCallbacks24);
+	createParam("pubSuppressed", asynParamInt32, &pubSuppressed25);
+	createParam("pubRatio", asynParamFloat64, &pubRatio26);
+	createParam("streamPos", asynParamFloat64, &streamPos27);
+	createParam("streamLost", asynParamInt32, &streamLost28);
+	createParam("expMarker", asynParamInt32, &expMarker29);
+	createParam("expReset", asynParamInt32, &expReset30);
+	createParam("expFrame", asynParamInt32, &expFrame31);
+	createParam("expFrames", asynParamFloat64Array, &expFrames32);
+	createParam("expStart", asynParamFloat64Array, &expStart33);
+	createParam("expSamples", asynParamFloat64Array, &expSamples34);
+	createParam("expLost", asynParamFloat64Array, &expLost35);
+	createParam("expMean", asynParamFloat64Array, &expMean36);
+	createParam("expStd", asynParamFloat64Array, &expStd37);
+	createParam("expMin", asynParamFloat64Array, &expMin38);
+	createParam("expMax", asynParamFloat64Array, &expMax39);
+	createParam("streamClients", asynParamInt32, &streamClients40);
+	createParam("streamClientRate", asynParamFloat64Array, &streamClientRate41);
+	createParam("streamClientFrames", asynParamFloat64Array, &streamClientFrames42);
+	createParam("streamClientDropped", asynParamFloat64Array, &streamClientDropped43);
+	createParam("streamClientGaps", asynParamFloat64Array, &streamClientGaps44);
+	createParam("streamClientDecim", asynParamFloat64Array, &streamClientDecim45);
+	createParam("driftEnable", asynParamInt32, &driftEnable46);
+	createParam("driftPressure", asynParamInt32, &driftPressure47);
+	createParam("driftReset", asynParamInt32, &driftReset48);
+	createParam("driftLag", asynParamFloat64, &driftLag49);
+	createParam("driftWindow", asynParamFloat64, &driftWindow50);
+	createParam("driftOffset", asynParamFloat64, &driftOffset51);
+	createParam("driftTempCoef", asynParamFloat64, &driftTempCoef52);
+	createParam("driftPressCoef", asynParamFloat64, &driftPressCoef53);
+	createParam("driftPredict", asynParamFloat64, &driftPredict54);
+	createParam("driftResidual", asynParamFloat64, &driftResidual55);
+	createParam("ecuTemp", asynParamFloat64, &ecuTemp56);
+	createParam("ecuPress", asynParamFloat64, &ecuPress57);
+	createParam("ecuHumid", asynParamFloat64, &ecuHumid58);
+	
+	batch.setCounterParams( 0, pubStaged23, pubCallbacks24, pubSuppressed25, pubRatio26 );
+	setDoubleParam( 0, pubRate20, FPS_DEFAULT_PUBRATE );
+	setIntegerParam( 0, expMarker29, expMarker );
+	setIntegerParam( 0, expFrame31, 0 );
+	setIntegerParam( 0, streamClients40, 0 );
+	setIntegerParam( 0, driftEnable46, 0 );
+	setIntegerParam( 0, driftPressure47, 0 );
+	setDoubleParam( 0, driftLag49, 0 );
+	setDoubleParam( 0, driftWindow50, FPS_DRIFT_WINDOW );
+
+	for( int addr = 0; addr < 3; addr++ )
+	{
+	setIntegerParam( addr, histLevel7, -1 );
+	setDoubleParam( addr, histStart8, 0 );
+	setDoubleParam( addr, histSpan9, 60 );
+	setDoubleParam( addr, histPeriod11, 0 );
+	setDoubleParam( addr, pubDeadband22, 0 );
+	lastValue[addr] = 0;
+	histMinBuf[addr].resize( FPS_HIST_POINTS );
+	histMaxBuf[addr].resize( FPS_HIST_POINTS );
+	histMeanBuf[addr].resize( FPS_HIST_POINTS );
+	histTimeBuf[addr].resize( FPS_HIST_POINTS );
+	histPoints[addr] = 0;
+	driftSum[addr] = 0;
+	}
+
+/** Register callback function
+ *
+ *  Registers a callback function for a device that will be called when new
+ *  position data are available. A callback function registered previously
+ *  is unregistered.
+ *  @param  devNo      Sequence number of the device
+ *  @param  callback   Callback function for the device. Use NULL to
+ *                     unregister a function.
+ *  @param  lbSmpTime  Logarithmic time distance of two subsequent position
+ *                     measurements: sample time = (2 ^ lbSmpTime) * 10.24us .
+ */
+	//start the position stream that feeds the history
+
+	//0 is the fastest rate the hardware offers, negative selects the default
+
+	if( lbSmpTime < 0 ) lbSmpTime = FPS_DEFAULT_LBSMPTIME;
+	if( lbSmpTime > 20 ) lbSmpTime = 20;
+	if( historySeconds <= 0 ) historySeconds = FPS_DEFAULT_HISTORY;
+
+	samplePeriod = 10.24e-6 * (1 << lbSmpTime);
+	history.configure( samplePeriod, historySeconds );
+	allan.configure( samplePeriod, FPS_ALLAN_MAXTAU );
+	exposure.configure( FPS_EXP_FRAMES );
+	expRecords.resize( FPS_EXP_FRAMES );
+	expBuf.resize( FPS_EXP_FRAMES );
+	drift.configure( FPS_DRIFT_TICK, FPS_DRIFT_MAXLAG );
+	setDriftModel();
+
+/** Read device configuration
+ *
+ *  Reads static device configuration data
+ *  @param  devNo      Sequence number of the device
+ *  @param  axisCount  Output: Number of enabled axes
+ *  @param  features   Output: Bitfield of enabled features
+ *  @return            Error code
+ */
+	//the stream markers are only valid with the DataMarker feature
+
+	unsigned int axisCount = 0;
+	int features = 0;
+	status = FPS_getDeviceConfig( devNo, &axisCount, &features );
+	markerEnabled = status == FPS_Ok && ( features & FPS_FeatureMarker );
+	bool ecuEnabled = status == FPS_Ok && ( features & FPS_FeatureEcu );
+
+	if( devNo < FPS_MAX_DEVICES )
+	{
+	fpsDevices[devNo] = this;
+	status = FPS_setPositionCallback( devNo, fpsPositionCallback, lbSmpTime );
+	fpsStatePrint(status);
+	}
+	else
+		cout << "devNo " << devNo << " out of range, no position stream" << endl;
+
+	epicsThreadCreate( "blcfpsPub", epicsThreadPriorityMedium,
+					   epicsThreadGetStackSize(epicsThreadStackMedium),
+					   (EPICSTHREADFUNC) pubTaskC, this );
+
+	//the drift model needs the ECU sensors
+	
+	if( ecuEnabled )
+		epicsThreadCreate( "blcfpsDrift", epicsThreadPriorityLow,
+						   epicsThreadGetStackSize(epicsThreadStackSmall),
+						   (EPICSTHREADFUNC) driftTaskC, this );
+	else
+		cout << "device " << devNo << " has no ECU, no drift model" << endl;
+		
+}
+
+//position stream from the library thread
+
+static void fpsPositionCallback( unsigned int devNo, unsigned int length, unsigned int index,
+								 const double * const positions[3], const bln32 * const markers[3] )
+{
+	
+	if( devNo < FPS_MAX_DEVICES && fpsDevices[devNo] )
+		fpsDevices[devNo]->processPositions( length, index, positions, markers );
+	
+}
+
+void blcfps::processPositions(unsigned int length, unsigned int index,
+							  const double * const positions[3], const bln32 * const markers[3])
+{
+	
+	double value[3];
+	fpsUInt64 first;
+	epicsTimeStamp stamp;
+	
+	//read once, blcfpsStreamConfigure may set it while the stream runs
+	
+	fpsStreamServer *server = streamServer;
+	
+	if( !markerEnabled ) markers = 0;
+	if( server ) epicsTimeGetCurrent( &stamp );
+	
+	dataLock.lock();
+
+	//the library index counts lost samples too but is reset from time to time,
+	//keep our own monotonic sample number so the history sees the gaps
+	
+	if( streamStarted && index > nextIndex )
+	{
+		sampleCount += index - nextIndex;
+		lostSamples += index - nextIndex;
+	}
+	streamStarted = true;
+	first = sampleCount;
+	
+	for( unsigned int i = 0; i < length; i++ )
+	{
+		//stream positions are in pm, the records show nm
+		
+		for( int axis = 0; axis < 3; axis++ )
+		{
+			value[axis] = positions[axis][i] * 1e-3;
+			driftSum[axis] += value[axis];
+		}
+		history.add( sampleCount + i, value );
+		allan.add( sampleCount + i, value );
+
+		//the detector gate on a DataMarker input frames the exposure
+		
+		bool gate = false;
+		if( markers )
+			gate = expMarker < 0 ? ( markers[0][i] || markers[1][i] || markers[2][i] ) != 0
+								 : markers[expMarker][i] != 0;
+		exposure.add( sampleCount + i, value, gate );
+	}
+	
+	if( length )
+		for( int axis = 0; axis < 3; axis++ )
+			lastValue[axis] = positions[axis][length - 1] * 1e-3;
+	
+	sampleCount += length;
+	driftCount += length;
+	nextIndex = index + length;
+	
+	dataLock.unlock();
+	
+	fpsMergeFeed( devNo, samplePeriod, first, length, positions, markers );
+	
+	if( server )
+		server->post( first, length, positions, markers, samplePeriod, stamp );
+	
+}
+
+//copy the requested history range of every axis into the waveform buffers
+
+void blcfps::queryHistory()
+{
+	
+	int level, usedLevel = 0;
+	double start, span;
+	
+	for( int addr = 0; addr < 3; addr++ )
+	{
+	getIntegerParam( addr, histLevel7, &level );
+	getDoubleParam( addr, histStart8, &start );
+	getDoubleParam( addr, histSpan9, &span );
+	
+	dataLock.lock();
+	histPoints[addr] = history.query( level, start, span, addr,
+								&histMinBuf[addr][0], &histMaxBuf[addr][0], &histMeanBuf[addr][0],
+								&histTimeBuf[addr][0], FPS_HIST_POINTS, &usedLevel );
+	dataLock.unlock();
+	
+	batch.stageDouble( addr, histPeriod11, history.levelPeriod(usedLevel) );
+	doCallbacksFloat64Array( &histMinBuf[addr][0], histPoints[addr], histMin12, addr );
+	doCallbacksFloat64Array( &histMaxBuf[addr][0], histPoints[addr], histMax13, addr );
+	doCallbacksFloat64Array( &histMeanBuf[addr][0], histPoints[addr], histMean14, addr );
+	doCallbacksFloat64Array( &histTimeBuf[addr][0], histPoints[addr], histTime15, addr );
+	}
+	
+}
+
+//publication task: stages the stream values and flushes the batch at pubRate
+
+static void pubTaskC(void *drvPvt)
+{
+	
+	blcfps *pblcfps = (blcfps *) drvPvt;
+	pblcfps->pubTask();
+	
+}
+
+void blcfps::pubTask()
+{
+	
+	double rate, deadband[3], pos[3], rates[3];
+	int lost, compensate;
+	
+	for( ;; )
+	{
+		lock();
+		getDoubleParam( 0, pubRate20, &rate );
+		for( int addr = 0; addr < 3; addr++ )
+			getDoubleParam( addr, pubDeadband22, &deadband[addr] );
+		getIntegerParam( 0, driftEnable46, &compensate );
+		unlock();
+		
+		//woken early by a rate change
+		
+		pubEvent.wait( rate > 0 ? 1.0 / rate : 1.0 );
+		
+		dataLock.lock();
+		for( int addr = 0; addr < 3; addr++ )
+		{
+			pos[addr] = lastValue[addr];
+			if( compensate ) pos[addr] -= drift.predict(addr);
+			rates[addr] = allan.driftRate(addr);
+		}
+		lost = (int) lostSamples;
+		bool started = streamStarted;
+		dataLock.unlock();
+		
+		if( started )
+		{
+			for( int addr = 0; addr < 3; addr++ )
+			{
+				batch.stageDouble( addr, streamPos27, pos[addr], deadband[addr] );
+				batch.stageDouble( addr, driftRate19, rates[addr] );
+			}
+			batch.stageInt( 0, streamLost28, lost );
+		}
+		
+		lock();
+		publishExposures();
+		if( streamServer ) publishStreamClients();
+		batch.flush();
+		unlock();
+	}
+	
+}
+
+//drift model task: one fit per ECU update
+
+static void driftTaskC(void *drvPvt)
+{
+	
+	blcfps *pblcfps = (blcfps *) drvPvt;
+	pblcfps->driftTask();
+	
+}
+
+void blcfps::driftTask()
+{
+	
+	double t, p, h, n, pos[3];
+	double offset[3], tempCoef[3], pressCoef[3], predict[3], residual[3];
+	int status;
+	
+	for( ;; )
+	{
+		epicsThreadSleep( FPS_DRIFT_TICK );
+		
+		lock();
+		status = FPS_getEcuData( devNo, &t, &p, &h, &n );
+		unlock();
+		if( status != FPS_Ok ) continue;
+		
+		//low-pass position: mean of the stream since the last tick
+		
+		dataLock.lock();
+		bool fresh = driftCount > 0;
+		for( int addr = 0; addr < 3; addr++ )
+		{
+			pos[addr] = fresh ? driftSum[addr] / driftCount : 0;
+			driftSum[addr] = 0;
+		}
+		driftCount = 0;
 		
+		drift.add( fresh ? pos : 0, t, p );
+		for( int addr = 0; addr < 3; addr++ )
+		{
+			offset[addr] = drift.offset(addr);
+			tempCoef[addr] = drift.tempCoef(addr);
+			pressCoef[addr] = drift.pressCoef(addr);
+			predict[addr] = drift.predict(addr);
+			residual[addr] = drift.residual(addr);
+		}
+		dataLock.unlock();
+		
+		batch.stageDouble( 0, ecuTemp56, t );
+		batch.stageDouble( 0, ecuPress57, p );
+		batch.stageDouble( 0, ecuHumid58, h );
+		for( int addr = 0; addr < 3; addr++ )
+		{
+			batch.stageDouble( addr, driftOffset51, offset[addr] );
+			batch.stageDouble( addr, driftTempCoef52, tempCoef[addr] );
+			batch.stageDouble( addr, driftPressCoef53, pressCoef[addr] );
+			batch.stageDouble( addr, driftPredict54, predict[addr] );
+			batch.stageDouble( addr, driftResidual55, residual[addr] );
+		}
+	}
+	
 }
+
+//apply lag, window and pressure term of the drift model, driver must be locked
+
+void blcfps::setDriftModel()
+{
+	
+	double lag, window;
+	int pressure;
+	
+	getDoubleParam( 0, driftLag49, &lag );
+	getDoubleParam( 0, driftWindow50, &window );
+	getIntegerParam( 0, driftPressure47, &pressure );
+	
+	dataLock.lock();
+	drift.setModel( lag, window, pressure != 0 );
+	dataLock.unlock();
+	
+}
+
+//send the frame records as waveforms when new frames were closed, driver must be locked
+
+void blcfps::publishExposures()
+{
+	
+	size_t n = 0;
+	
+	dataLock.lock();
+	epicsUInt32 frame = exposure.frameCount();
+	if( frame != expPublished || expCleared )
+		n = exposure.copy( &expRecords[0], FPS_EXP_FRAMES );
+	dataLock.unlock();
+	
+	if( frame == expPublished && !expCleared ) return;
+	expPublished = frame;
+	expCleared = false;
+	
+	batch.stageInt( 0, expFrame31, (int) frame );
+	
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].frame;
+	doCallbacksFloat64Array( &expBuf[0], n, expFrames32, 0 );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].start * samplePeriod;
+	doCallbacksFloat64Array( &expBuf[0], n, expStart33, 0 );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].samples;
+	doCallbacksFloat64Array( &expBuf[0], n, expSamples34, 0 );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].lost;
+	doCallbacksFloat64Array( &expBuf[0], n, expLost35, 0 );
+	
+	for( int addr = 0; addr < 3; addr++ )
+	{
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].mean[addr];
+	doCallbacksFloat64Array( &expBuf[0], n, expMean36, addr );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].std[addr];
+	doCallbacksFloat64Array( &expBuf[0], n, expStd37, addr );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].min[addr];
+	doCallbacksFloat64Array( &expBuf[0], n, expMin38, addr );
+	for( size_t i = 0; i < n; i++ ) expBuf[i] = expRecords[i].max[addr];
+	doCallbacksFloat64Array( &expBuf[0], n, expMax39, addr );
+	}
+	
+}
+
 //interface readInt32
 
 asynStatus blcfps :: readInt32(asynUser *pasynUser, epicsInt32 *value)
@@ -227,15 +821,69 @@ asynStatus blcfps::writeInt32(asynUser *pasynUser, epicsInt32 value)
 	status = FPS_resetAxis( devNo, addr );
 	fpsStatePrint(status);
 	
+	//the position jumps, the stability statistics and the drift fit start over
+	
+	dataLock.lock();
+	allan.reset();
+	drift.reset();
+	dataLock.unlock();
+	
 	}
 
     /* Set the parameter in the parameter library. */
 	
     status = (asynStatus) setIntegerParam(addr, function, value);
 
-    /* Do callbacks so higher layers see any changes */
+	//new range or periodic refresh of the history waveforms
+	
+	if( function == histLevel7 || function == histQuery10 )
+		queryHistory();
+
+	//restart the stability statistics of all axes
+	
+	if( function == allanReset16 )
+	{
+	dataLock.lock();
+	allan.reset();
+	dataLock.unlock();
+	}
+
+	//gate input of the exposure integrator, the frames are kept
+	
+	if( function == expMarker29 )
+	{
+	dataLock.lock();
+	expMarker = value < 0 ? -1 : value > 2 ? 2 : value;
+	dataLock.unlock();
+	}
+	
+	//restart the frame counter, the next publication sends the cleared records
+	
+	if( function == expReset30 )
+	{
+	dataLock.lock();
+	exposure.reset();
+	dataLock.unlock();
+	expCleared = true;
+	}
+
+	//thermal drift model
 	
-    status = (asynStatus) callParamCallbacks(addr, addr);
+	if( function == driftPressure47 )
+		setDriftModel();
+	
+	if( function == driftReset48 )
+	{
+	dataLock.lock();
+	drift.reset();
+	dataLock.unlock();
+	}
+
+    /* Higher layers see the change with the next publication, or now on pubFlush */
+	
+	batch.stageInt( addr, function, value );
+	if( function == pubFlush21 )
+		batch.flush();
     
     if (status) 
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize, 
@@ -268,8 +916,18 @@ asynStatus blcfps :: readFloat64(asynUser *pasynUser, epicsFloat64 *value)
 	if( function == getPosition5)
 	{
 		
-	int status;
+	int status, compensate;
 	status = FPS_getPosition( devNo, addr, &position );
+	
+	//subtract the predicted thermal drift if enabled
+	
+	getIntegerParam( 0, driftEnable46, &compensate );
+	if( compensate )
+	{
+	dataLock.lock();
+	position -= drift.predict( addr );
+	dataLock.unlock();
+	}
 	setDoubleParam( addr, getPosition5, position );
 	
 	}
@@ -302,10 +960,183 @@ asynStatus blcfps :: readFloat64(asynUser *pasynUser, epicsFloat64 *value)
 
 
 
+//interface writeFloat64
+
+asynStatus blcfps::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
+{
+	
+    int function = pasynUser->reason;
+    int addr=0;
+    asynStatus status = asynSuccess;
+    const char* functionName = "writeFloat64";
+
+    status = getAddress(pasynUser, &addr); if (status != asynSuccess) return(status);
+
+	//a rate near 0 would stall the publication, a high one floods CA
+
+	if( function == pubRate20 )
+	{
+		if( !( value >= FPS_MIN_PUBRATE ) ) value = FPS_MIN_PUBRATE;
+		if( value > FPS_MAX_PUBRATE ) value = FPS_MAX_PUBRATE;
+	}
+
+    status = (asynStatus) setDoubleParam(addr, function, value);
+
+	if( function == histStart8 || function == histSpan9 )
+		queryHistory();
+
+	if( function == pubRate20 )
+		pubEvent.signal();
+
+	if( function == driftLag49 || function == driftWindow50 )
+		setDriftModel();
+
+	batch.stageDouble( addr, function, value );
+    
+    if (status) 
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize, 
+                  "%s:%s: status=%d, function=%d, value=%f", 
+                  driverName, functionName, status, function, value);
+    else        
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, 
+              "%s:%s: function=%d, value=%f\n", 
+              driverName, functionName, function, value);
+    return status;
+	
+}
+
+//interface readFloat64Array, returns the last history query
+
+asynStatus blcfps::readFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn)
+{
+	
+    int function = pasynUser->reason;
+    int addr=0;
+    asynStatus status = asynSuccess;
+    const double *buf = 0;
+    static const char *functionName = "readFloat64Array";
+    
+    status = getAddress(pasynUser, &addr); if (status != asynSuccess) return(status);
+
+	//the Allan deviation curve is evaluated on every read
+	
+	if( function == allanTau17 || function == allanDev18 )
+	{
+	double tau[FPS_ALLAN_TAUS], adev[FPS_ALLAN_TAUS];
+	size_t n;
+	
+	dataLock.lock();
+	n = allan.deviation( addr, tau, adev, FPS_ALLAN_TAUS );
+	dataLock.unlock();
+	
+	*nIn = n < nElements ? n : nElements;
+	for( size_t i = 0; i < *nIn; i++ )
+		value[i] = function == allanTau17 ? tau[i] : adev[i];
+	return status;
+	}
+
+	if( function == histMin12 ) buf = &histMinBuf[addr][0];
+	else if( function == histMax13 ) buf = &histMaxBuf[addr][0];
+	else if( function == histMean14 ) buf = &histMeanBuf[addr][0];
+	else if( function == histTime15 ) buf = &histTimeBuf[addr][0];
+	
+	if( !buf )
+	{
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize, 
+                  "%s:%s: no array for function=%d", 
+                  driverName, functionName, function);
+		return asynError;
+	}
+	
+	*nIn = histPoints[addr] < nElements ? histPoints[addr] : nElements;
+	for( size_t i = 0; i < *nIn; i++ )
+		value[i] = buf[i];
+	
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER, 
+              "%s:%s: function=%d, nIn=%d\n", 
+              driverName, functionName, function, (int) *nIn);
+	return status;
+	
+}
+
+//start the TCP stream, called once from iocsh
+
+bool blcfps::startStreamServer(const char *bindAddr, int tcpPort, int policy, int queueFrames)
+{
+	
+	lock();
+	bool running = streamServer != 0;
+	unlock();
+	if( running ) return false;
+	
+	fpsStreamServer *server = new fpsStreamServer( devNo, bindAddr, tcpPort, policy, queueFrames );
+	if( !server->start() )
+	{
+		delete server;
+		return false;
+	}
+	
+	//the publication task reads the server under the driver lock
+	
+	lock();
+	for( int slot = 0; slot < FPS_STREAM_CLIENTS; slot++ )
+		streamBytes[slot] = 0;
+	epicsTimeGetCurrent( &streamStatTime );
+	streamServer = server;
+	unlock();
+	return true;
+	
+}
+
+//per client throughput and drop counters, driver must be locked
+
+void blcfps::publishStreamClients()
+{
+	
+	epicsTimeStamp now;
+	fpsStreamStats stat;
+	double rate[FPS_STREAM_CLIENTS], frames[FPS_STREAM_CLIENTS], dropped[FPS_STREAM_CLIENTS];
+	double gaps[FPS_STREAM_CLIENTS], decim[FPS_STREAM_CLIENTS];
+	int connected = 0;
+	
+	epicsTimeGetCurrent( &now );
+	double dt = epicsTimeDiffInSeconds( &now, &streamStatTime );
+	streamStatTime = now;
+	
+	for( int slot = 0; slot < FPS_STREAM_CLIENTS; slot++ )
+	{
+		streamServer->stats( slot, &stat );
+		
+		//bytes per second since the last publication, a new client restarts at 0
+		
+		rate[slot] = dt > 0 && stat.bytes >= streamBytes[slot] ? (stat.bytes - streamBytes[slot]) / dt : 0;
+		streamBytes[slot] = stat.bytes;
+		frames[slot] = stat.frames;
+		dropped[slot] = stat.dropped;
+		gaps[slot] = stat.gaps;
+		decim[slot] = stat.connected ? stat.decimation : 0;
+		if( stat.connected ) connected++;
+	}
+	
+	batch.stageInt( 0, streamClients40, connected );
+	doCallbacksFloat64Array( rate, FPS_STREAM_CLIENTS, streamClientRate41, 0 );
+	doCallbacksFloat64Array( frames, FPS_STREAM_CLIENTS, streamClientFrames42, 0 );
+	doCallbacksFloat64Array( dropped, FPS_STREAM_CLIENTS, streamClientDropped43, 0 );
+	doCallbacksFloat64Array( gaps, FPS_STREAM_CLIENTS, streamClientGaps44, 0 );
+	doCallbacksFloat64Array( decim, FPS_STREAM_CLIENTS, streamClientDecim45, 0 );
+	
+}
+
 //the class destructor function
 
 blcfps::~blcfps()
 {
+	//stop the stream before the device goes away
+	
+	FPS_setPositionCallback( devNo, 0, 0 );
+	if( devNo < FPS_MAX_DEVICES )
+		fpsDevices[devNo] = 0;
+	
 	//disconnect the device
 	
 	FPS_disconnect( devNo );
@@ -316,23 +1147,68 @@ blcfps::~blcfps()
 /******************The following is the code needn't to be modified*/ 
 //banding to the epics iocsh shell
 
-extern "C" int blcfpsConfigure(const char* portName, int devNo)
+extern "C" int blcfpsConfigure(const char* portName, int devNo, int lbSmpTime, double historySeconds)
 {
 	
-	blcfps *pblcfps = new blcfps(portName, devNo);
+	blcfps *pblcfps = new blcfps(portName, devNo, lbSmpTime, historySeconds);
 	return asynSuccess;
 	
 }
 
 static const iocshArg blcfpsArg0 = {"Port name", iocshArgString};
 static const iocshArg blcfpsArg1 = {"number", iocshArgInt};
-static const iocshArg * const blcfpsArgs[] = {&blcfpsArg0, &blcfpsArg1};
+static const iocshArg blcfpsArg2 = {"lbSmpTime", iocshArgInt};
+static const iocshArg blcfpsArg3 = {"history seconds", iocshArgDouble};
+static const iocshArg * const blcfpsArgs[] = {&blcfpsArg0, &blcfpsArg1, &blcfpsArg2, &blcfpsArg3};
 
-static const iocshFuncDef blcfpsFuncDef = {"blcfpsConfigure", 2, blcfpsArgs};
+static const iocshFuncDef blcfpsFuncDef = {"blcfpsConfigure", 4, blcfpsArgs};
 static void blcfpsConfigCallFunc(const iocshArgBuf *args)
 {
 	
-	blcfpsConfigure(args[0].sval, args[1].ival);
+	blcfpsConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].dval);
+	
+}
+
+//TCP stream of the raw position packets
+
+extern "C" int blcfpsStreamConfigure(const char* portName, int tcpPort, const char* bindAddr,
+									 int policy, int queueFrames)
+{
+	
+	//the port may exist but belong to another driver, e.g. a merge port
+	
+	asynPortDriver *pDriver = (asynPortDriver *) findAsynPortDriver(portName);
+	blcfps *pblcfps = dynamic_cast<blcfps *>( pDriver );
+	
+	if( !pblcfps )
+	{
+		cout << "blcfpsStreamConfigure: port " << portName << " not found or not a blcfps port" << endl;
+		return asynError;
+	}
+	
+	if( !pblcfps->startStreamServer(bindAddr, tcpPort, policy, queueFrames) )
+	{
+		cout << "blcfpsStreamConfigure: cannot listen on port " << tcpPort << endl;
+		return asynError;
+	}
+	
+	return asynSuccess;
+	
+}
+
+static const iocshArg blcfpsStreamArg0 = {"Port name", iocshArgString};
+static const iocshArg blcfpsStreamArg1 = {"TCP port", iocshArgInt};
+static const iocshArg blcfpsStreamArg2 = {"bind address", iocshArgString};
+static const iocshArg blcfpsStreamArg3 = {"policy", iocshArgInt};
+static const iocshArg blcfpsStreamArg4 = {"queue frames", iocshArgInt};
+static const iocshArg * const blcfpsStreamArgs[] = {&blcfpsStreamArg0, &blcfpsStreamArg1, &blcfpsStreamArg2,
+													&blcfpsStreamArg3, &blcfpsStreamArg4};
+
+static const iocshFuncDef blcfpsStreamFuncDef = {"blcfpsStreamConfigure", 5, blcfpsStreamArgs};
+static void blcfpsStreamCallFunc(const iocshArgBuf *args)
+{
+	
+	blcfpsStreamConfigure(args[0].sval, args[1].ival, args[2].sval, args[3].ival, args[4].ival);
 	
 }
 
@@ -340,6 +1216,7 @@ void drvblcfpsRegister(void)
 {
 	
 	iocshRegister(&blcfpsFuncDef, blcfpsConfigCallFunc);
+	iocshRegister(&blcfpsStreamFuncDef, blcfpsStreamCallFunc);
 	
 }
 
@@ -0,0 +1,190 @@
+/*Online Allan deviation and drift rate for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <math.h>
+#include <epicsMath.h>
+#include <fpsAllan.h>
+
+fpsAllan::fpsAllan():
+	samplePeriod(0),
+	taus(0),
+	blockLevels(0)
+{
+	reset();
+}
+
+void fpsAllan::configure(double samplePeriod_, double maxTau)
+{
+	samplePeriod = samplePeriod_;
+
+	taus = 1;
+	while( taus < FPS_ALLAN_TAUS && samplePeriod * ldexp(1.0, taus) <= maxTau )
+		taus++;
+
+	blockLevels = taus - FPS_ALLAN_OVERLAP_LB;
+	if( blockLevels < 1 ) blockLevels = 1;
+
+	reset();
+}
+
+void fpsAllan::reset()
+{
+	started = false;
+	next = 0;
+
+	for( int m = 0; m < FPS_ALLAN_TAUS; m++ )
+	{
+		allanTau &t = tau[m];
+		t.length = m > FPS_ALLAN_OVERLAP_LB ? FPS_ALLAN_OVERLAP : 1u << m;
+		t.count = 0;
+		for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+			t.sumSq[a] = 0;
+	}
+	restartCascade();
+
+	first = 0;
+	fitCount = 0;
+	meanT = 0;
+	m2T = 0;
+	for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+	{
+		meanX[a] = 0;
+		cTX[a] = 0;
+	}
+}
+
+void fpsAllan::add(fpsUInt64 sample, const double *value)
+{
+	double x[FPS_ALLAN_AXES];
+
+	if( taus == 0 ) return;
+
+	if( !started )
+	{
+		for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+			reference[a] = value[a];
+		first = sample;
+		started = true;
+	}
+	else if( sample != next )
+		restartCascade();
+	next = sample + 1;
+
+	for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+		x[a] = value[a] - reference[a];
+
+	//line fit against time
+
+	double t = (sample - first) * samplePeriod;
+	fitCount += 1;
+	double dt = t - meanT;
+	meanT += dt / fitCount;
+	m2T += dt * (t - meanT);
+	for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+	{
+		meanX[a] += (x[a] - meanX[a]) / fitCount;
+		cTX[a] += dt * (x[a] - meanX[a]);
+	}
+
+	addBlock(0, x);
+}
+
+//drop the partial blocks and windows, the next sample starts a new run
+
+void fpsAllan::restartCascade()
+{
+	for( int m = 0; m < FPS_ALLAN_TAUS; m++ )
+	{
+		tau[m].head = 0;
+		tau[m].filled = 0;
+		block[m].half = false;
+	}
+}
+
+//pass a block sum to its taus and pair it up into the next block level
+
+void fpsAllan::addBlock(int level, double *sum)
+{
+	for( ;; )
+	{
+		if( level == 0 )
+		{
+			for( int m = 0; m <= FPS_ALLAN_OVERLAP_LB && m < taus; m++ )
+				addTau(m, sum);
+		}
+		else if( level + FPS_ALLAN_OVERLAP_LB < taus )
+			addTau(level + FPS_ALLAN_OVERLAP_LB, sum);
+
+		if( level + 1 >= blockLevels ) return;
+
+		allanBlock &b = block[level];
+		if( !b.half )
+		{
+			for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+				b.pending[a] = sum[a];
+			b.half = true;
+			return;
+		}
+
+		for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+			sum[a] += b.pending[a];
+		b.half = false;
+		level++;
+	}
+}
+
+//one more difference of two adjacent window averages of tau m
+
+void fpsAllan::addTau(int m, const double *sum)
+{
+	allanTau &t = tau[m];
+	unsigned int size = 2 * t.length;
+
+	for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+		t.ring[a][t.head] = sum[a];
+	t.head = (t.head + 1) % size;
+	if( t.filled < size ) t.filled++;
+	if( t.filled < size ) return;
+
+	//after the wrap head points at the oldest block
+
+	double scale = 1.0 / ldexp(1.0, m);
+	for( int a = 0; a < FPS_ALLAN_AXES; a++ )
+	{
+		double older = 0, newer = 0;
+		for( unsigned int i = 0; i < t.length; i++ )
+		{
+			older += t.ring[a][(t.head + i) % size];
+			newer += t.ring[a][(t.head + t.length + i) % size];
+		}
+		double d = (newer - older) * scale;
+		t.sumSq[a] += d * d;
+	}
+	t.count++;
+}
+
+size_t fpsAllan::deviation(int axis, double *tauOut, double *adev, size_t maxPoints) const
+{
+	size_t n = 0;
+
+	if( axis < 0 || axis >= FPS_ALLAN_AXES ) return 0;
+
+	for( int m = 0; m < taus && n < maxPoints; m++ )
+	{
+		if( tau[m].count == 0 ) continue;
+		tauOut[n] = samplePeriod * ldexp(1.0, m);
+		adev[n] = sqrt(tau[m].sumSq[axis] / (2.0 * tau[m].count));
+		n++;
+	}
+
+	return n;
+}
+
+double fpsAllan::driftRate(int axis) const
+{
+	if( axis < 0 || axis >= FPS_ALLAN_AXES || m2T <= 0 ) return epicsNAN;
+	return cTX[axis] / m2T;
+}
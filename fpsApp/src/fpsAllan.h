@@ -0,0 +1,108 @@
+/*Online Allan deviation and drift rate for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Overlapping Allan deviation at octave spaced tau = 2^m * sample period.
+The samples are summed into a cascade of non-overlapping blocks of 2^j
+samples. Tau m is evaluated on blocks of level max(0, m - 3), so short
+taus are fully overlapping and long taus use FPS_ALLAN_OVERLAP windows
+per tau. Memory is fixed and the work per sample is O(1) amortized.
+
+A jump of the sample number (samples lost by the stream) restarts the
+block cascade, so no difference spans a gap; the sums collected before
+are kept.
+
+The drift rate is the slope of a least squares line through all samples
+since the last reset.
+
+*/
+
+#ifndef FPSALLAN_H
+#define FPSALLAN_H
+
+#include <epicsTypes.h>
+#include <fpsTypes.h>
+
+#define FPS_ALLAN_AXES			3
+#define FPS_ALLAN_TAUS			32
+#define FPS_ALLAN_OVERLAP_LB	3
+#define FPS_ALLAN_OVERLAP		(1<<FPS_ALLAN_OVERLAP_LB)	//windows per tau on long taus
+
+class fpsAllan
+{
+
+public:
+	fpsAllan();
+
+	/** Set the time base and clear all data
+	 *
+	 *  @param  samplePeriod  Time between two stream samples (s)
+	 *  @param  maxTau        Longest tau to evaluate (s)
+	 */
+	void configure(double samplePeriod, double maxTau);
+
+	void reset();
+
+	/** Add one sample of all axes
+	 *
+	 *  @param  sample   Monotonic sample number, used as time for the drift rate
+	 *  @param  value    Positions of axes 1, 2 and 3
+	 */
+	void add(fpsUInt64 sample, const double *value);
+
+	/** Read the deviation curve
+	 *
+	 *  Only taus that have at least one difference are returned.
+	 *  @param  axis       Axis number (0 ... 2)
+	 *  @param  tau        Output: tau values (s)
+	 *  @param  adev       Output: Allan deviation, same unit as the samples
+	 *  @param  maxPoints  Capacity of the output arrays
+	 *  @return            Number of points written
+	 */
+	size_t deviation(int axis, double *tau, double *adev, size_t maxPoints) const;
+
+	/** Drift rate of an axis in sample units per second */
+	double driftRate(int axis) const;
+
+private:
+	struct allanTau
+	{
+		double ring[FPS_ALLAN_AXES][2 * FPS_ALLAN_OVERLAP];	//last block sums
+		unsigned int length;				//blocks per averaging window
+		unsigned int head;
+		unsigned int filled;
+		double sumSq[FPS_ALLAN_AXES];
+		fpsUInt64 count;
+	};
+
+	struct allanBlock
+	{
+		double pending[FPS_ALLAN_AXES];
+		bool half;
+	};
+
+	void restartCascade();
+	void addBlock(int level, double *sum);
+	void addTau(int m, const double *sum);
+
+	double samplePeriod;
+	int taus;
+	int blockLevels;
+	bool started;
+	fpsUInt64 next;						//expected next sample number
+	double reference[FPS_ALLAN_AXES];		//first sample, keeps the sums small
+	allanTau tau[FPS_ALLAN_TAUS];
+	allanBlock block[FPS_ALLAN_TAUS];
+
+	//running line fit, Welford style
+
+	fpsUInt64 first;
+	double fitCount;
+	double meanT;
+	double meanX[FPS_ALLAN_AXES];
+	double m2T;
+	double cTX[FPS_ALLAN_AXES];
+
+};
+
+#endif
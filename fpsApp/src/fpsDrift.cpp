@@ -0,0 +1,189 @@
+/*Thermal drift model for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <math.h>
+#include <fpsDrift.h>
+
+#define FPS_DRIFT_SETTLE	600			//ticks fitted before a prediction is given
+
+//prior variance of offset (nm^2), temperature (nm/K)^2 and pressure (nm/hPa)^2
+//coefficients; it also bounds the covariance when the ECU values stay constant
+
+static const double driftPrior[FPS_DRIFT_TERMS] = { 1e6, 1e4, 1e4 };
+
+fpsDrift::fpsDrift():
+	tick(0.1),
+	lagTicks(0),
+	lambda(1),
+	usePressure(false),
+	terms(2),
+	head(0),
+	filled(0)
+{
+	reset();
+}
+
+void fpsDrift::configure(double tick_, double maxLag)
+{
+	tick = tick_ > 0 ? tick_ : 0.1;
+	size_t size = (size_t) (maxLag / tick) + 1;
+
+	ringT.assign( size, 0 );
+	ringP.assign( size, 0 );
+	head = 0;
+	filled = 0;
+	lagTicks = 0;
+
+	reset();
+}
+
+void fpsDrift::setModel(double lag, double window, bool usePressure_)
+{
+	size_t size = ringT.size();
+
+	lagTicks = lag > 0 ? (size_t) (lag / tick + 0.5) : 0;
+	if( size && lagTicks > size - 1 ) lagTicks = size - 1;
+
+	if( window < 10 * tick ) window = 10 * tick;
+	lambda = 1 - tick / window;
+
+	if( usePressure_ != usePressure )
+	{
+		usePressure = usePressure_;
+		reset();
+	}
+}
+
+void fpsDrift::reset()
+{
+	terms = usePressure ? 3 : 2;
+	started = false;
+	fitted = 0;
+	t0 = 0;
+	p0 = 0;
+
+	for( int i = 0; i < FPS_DRIFT_TERMS; i++ )
+		for( int j = 0; j < FPS_DRIFT_TERMS; j++ )
+			P[i][j] = i == j ? driftPrior[i] : 0;
+
+	for( int a = 0; a < FPS_DRIFT_AXES; a++ )
+	{
+		y0[a] = 0;
+		err2[a] = 0;
+		for( int i = 0; i < FPS_DRIFT_TERMS; i++ )
+			theta[a][i] = 0;
+	}
+}
+
+//offset, lagged temperature and pressure (hPa) relative to the first tick
+
+void fpsDrift::regressor(double *x) const
+{
+	size_t lagged = (head + ringT.size() - 1 - lagTicks) % ringT.size();
+
+	x[0] = 1;
+	x[1] = ringT[lagged] - t0;
+	x[2] = usePressure ? ( ringP[lagged] - p0 ) * 1e-2 : 0;
+}
+
+void fpsDrift::add(const double *position, double temperature, double pressure)
+{
+	if( ringT.empty() ) return;
+
+	ringT[head] = temperature;
+	ringP[head] = pressure;
+	head = (head + 1) % ringT.size();
+	if( filled < ringT.size() ) filled++;
+
+	if( !position || filled <= lagTicks ) return;
+
+	if( !started )
+	{
+		size_t lagged = (head + ringT.size() - 1 - lagTicks) % ringT.size();
+		t0 = ringT[lagged];
+		p0 = ringP[lagged];
+		for( int a = 0; a < FPS_DRIFT_AXES; a++ )
+			y0[a] = position[a];
+		started = true;
+	}
+
+	//gain from the shared covariance
+
+	double x[FPS_DRIFT_TERMS], Px[FPS_DRIFT_TERMS];
+	double denom = lambda;
+
+	regressor(x);
+	for( int i = 0; i < terms; i++ )
+	{
+		Px[i] = 0;
+		for( int j = 0; j < terms; j++ )
+			Px[i] += P[i][j] * x[j];
+		denom += x[i] * Px[i];
+	}
+
+	for( int a = 0; a < FPS_DRIFT_AXES; a++ )
+	{
+		double e = position[a] - y0[a];
+		for( int i = 0; i < terms; i++ )
+			e -= theta[a][i] * x[i];
+		for( int i = 0; i < terms; i++ )
+			theta[a][i] += Px[i] / denom * e;
+		err2[a] = lambda * err2[a] + (1 - lambda) * e * e;
+	}
+
+	for( int i = 0; i < terms; i++ )
+		for( int j = 0; j < terms; j++ )
+			P[i][j] = ( P[i][j] - Px[i] * Px[j] / denom ) / lambda;
+
+	//forgetting winds the covariance up while the ECU values are constant,
+	//scale it back to the prior so a later step is not overfitted
+
+	for( int i = 0; i < terms; i++ )
+	{
+		if( P[i][i] <= driftPrior[i] ) continue;
+		double s = sqrt( driftPrior[i] / P[i][i] );
+		for( int j = 0; j < terms; j++ )
+		{
+			P[i][j] *= s;
+			P[j][i] *= s;
+		}
+	}
+
+	fitted++;
+}
+
+double fpsDrift::predict(int axis) const
+{
+	if( fitted < FPS_DRIFT_SETTLE ) return 0;
+
+	double x[FPS_DRIFT_TERMS];
+	regressor(x);
+
+	double drift = 0;
+	for( int i = 1; i < terms; i++ )
+		drift += theta[axis][i] * x[i];
+	return drift;
+}
+
+double fpsDrift::offset(int axis) const
+{
+	return y0[axis] + theta[axis][0];
+}
+
+double fpsDrift::tempCoef(int axis) const
+{
+	return theta[axis][1];
+}
+
+double fpsDrift::pressCoef(int axis) const
+{
+	return usePressure ? theta[axis][2] : 0;
+}
+
+double fpsDrift::residual(int axis) const
+{
+	return sqrt( err2[axis] );
+}
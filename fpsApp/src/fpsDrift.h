@@ -0,0 +1,101 @@
+/*Thermal drift model for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Every tick (100 ms, the ECU update rate) the low-pass position of each
+axis is fitted against the lagged ECU temperature and, optionally, the
+air pressure:
+
+  position = offset + tempCoef * (T - T0) + pressCoef * (p - p0)
+
+T0 and p0 are the ECU values of the first tick. Recursive least squares
+with exponential forgetting tracks slow changes of the coefficients.
+All axes share the regressors, so the gain and covariance are computed
+once per tick and only the coefficients are per axis.
+
+*/
+
+#ifndef FPSDRIFT_H
+#define FPSDRIFT_H
+
+#include <vector>
+#include <epicsTypes.h>
+
+#define FPS_DRIFT_AXES		3
+#define FPS_DRIFT_TERMS		3			//offset, temperature, pressure
+
+class fpsDrift
+{
+
+public:
+	fpsDrift();
+
+	/** Set the time base and clear all data
+	 *
+	 *  @param  tick     Time between two calls of add() (s)
+	 *  @param  maxLag   Longest ECU lag that can be selected (s)
+	 */
+	void configure(double tick, double maxLag);
+
+	/** Change the model, only a change of the pressure term resets the fit
+	 *
+	 *  @param  lag          Delay of the position behind the ECU values (s)
+	 *  @param  window       Forgetting time constant of the fit (s)
+	 *  @param  usePressure  Fit the pressure term too
+	 */
+	void setModel(double lag, double window, bool usePressure);
+
+	void reset();
+
+	/** Add one tick
+	 *
+	 *  @param  position      Low-pass positions of axes 1, 2 and 3 (nm),
+	 *                        NULL if the stream delivered no sample
+	 *  @param  temperature   ECU temperature (degC)
+	 *  @param  pressure      ECU air pressure (Pa)
+	 */
+	void add(const double *position, double temperature, double pressure);
+
+	/** Predicted drift of an axis for the current lagged ECU values,
+	 *  relative to T0 and p0 (nm), 0 until the fit has settled */
+	double predict(int axis) const;
+
+	double offset(int axis) const;
+	double tempCoef(int axis) const;			//nm/K
+	double pressCoef(int axis) const;			//nm/hPa
+
+	/** Exponentially weighted rms of the a priori fit error (nm) */
+	double residual(int axis) const;
+
+	/** Ticks fitted since the last reset */
+	epicsUInt32 updates() const { return fitted; }
+
+private:
+	void regressor(double *x) const;
+
+	double tick;
+	size_t lagTicks;
+	double lambda;						//forgetting factor
+	bool usePressure;
+	int terms;
+
+	//ECU history for the lag, newest at head - 1
+
+	std::vector<double> ringT;
+	std::vector<double> ringP;
+	size_t head;
+	size_t filled;
+
+	bool started;
+	double t0;
+	double p0;
+	double y0[FPS_DRIFT_AXES];			//first position, keeps the offsets small
+
+	double P[FPS_DRIFT_TERMS][FPS_DRIFT_TERMS];
+	double theta[FPS_DRIFT_AXES][FPS_DRIFT_TERMS];
+	double err2[FPS_DRIFT_AXES];
+	epicsUInt32 fitted;
+
+};
+
+#endif
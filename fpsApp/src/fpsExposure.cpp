@@ -0,0 +1,98 @@
+/*Per exposure position statistics for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <math.h>
+#include <fpsExposure.h>
+
+fpsExposure::fpsExposure():
+	head(0),
+	filled(0),
+	frame(0),
+	open(false),
+	next(0)
+{
+}
+
+void fpsExposure::configure(size_t frames)
+{
+	ring.resize( frames > 0 ? frames : 1 );
+	reset();
+}
+
+void fpsExposure::reset()
+{
+	head = 0;
+	filled = 0;
+	frame = 0;
+	open = false;
+}
+
+void fpsExposure::add(fpsUInt64 sample, const double *value, bool gate)
+{
+	if( !gate )
+	{
+		if( open ) close();
+		return;
+	}
+
+	if( !open )
+	{
+		open = true;
+		current.start = sample;
+		current.samples = 0;
+		current.lost = 0;
+		for( int a = 0; a < FPS_EXP_AXES; a++ )
+		{
+			current.mean[a] = 0;
+			current.min[a] = value[a];
+			current.max[a] = value[a];
+			m2[a] = 0;
+		}
+	}
+	else if( sample > next )
+		current.lost += (epicsUInt32) (sample - next);
+
+	next = sample + 1;
+	current.samples++;
+
+	//Welford update, stable for long exposures of large positions
+
+	for( int a = 0; a < FPS_EXP_AXES; a++ )
+	{
+		double d = value[a] - current.mean[a];
+		current.mean[a] += d / current.samples;
+		m2[a] += d * (value[a] - current.mean[a]);
+		if( value[a] < current.min[a] ) current.min[a] = value[a];
+		if( value[a] > current.max[a] ) current.max[a] = value[a];
+	}
+}
+
+void fpsExposure::close()
+{
+	open = false;
+	if( ring.empty() ) return;
+
+	current.frame = ++frame;
+	for( int a = 0; a < FPS_EXP_AXES; a++ )
+		current.std[a] = current.samples > 1 ? sqrt(m2[a] / (current.samples - 1)) : 0;
+
+	ring[head] = current;
+	head = (head + 1) % ring.size();
+	if( filled < ring.size() ) filled++;
+}
+
+size_t fpsExposure::copy(fpsExposureRecord *out, size_t maxFrames) const
+{
+	if( ring.empty() ) return 0;
+
+	size_t n = filled < maxFrames ? filled : maxFrames;
+	size_t first = (head + ring.size() - n) % ring.size();
+
+	for( size_t i = 0; i < n; i++ )
+		out[i] = ring[(first + i) % ring.size()];
+
+	return n;
+}
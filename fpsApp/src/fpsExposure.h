@@ -0,0 +1,84 @@
+/*Per exposure position statistics for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+A detector gate on a DataMarker input opens an integration window with
+its first marked sample and closes it with the first unmarked one.
+Mean, standard deviation, min and max of every axis are accumulated in
+streaming fashion, each closed window is appended to a ring of frame
+records numbered by a frame counter.
+
+*/
+
+#ifndef FPSEXPOSURE_H
+#define FPSEXPOSURE_H
+
+#include <vector>
+#include <epicsTypes.h>
+#include <fpsTypes.h>
+
+#define FPS_EXP_AXES	3
+
+struct fpsExposureRecord
+{
+	epicsUInt32 frame;				//frame counter, starts at 1 after reset
+	fpsUInt64 start;				//sample number of the first sample in the window
+	epicsUInt32 samples;			//samples integrated
+	epicsUInt32 lost;				//samples lost by the stream inside the window
+	double mean[FPS_EXP_AXES];
+	double std[FPS_EXP_AXES];
+	double min[FPS_EXP_AXES];
+	double max[FPS_EXP_AXES];
+};
+
+class fpsExposure
+{
+
+public:
+	fpsExposure();
+
+	/** Allocate the frame ring and clear all data
+	 *
+	 *  @param  frames   Number of frame records kept
+	 */
+	void configure(size_t frames);
+
+	void reset();
+
+	/** Add one sample of all axes
+	 *
+	 *  @param  sample   Monotonic sample number
+	 *  @param  value    Positions of axes 1, 2 and 3
+	 *  @param  gate     Marker state of the sample
+	 */
+	void add(fpsUInt64 sample, const double *value, bool gate);
+
+	/** Copy the frame records, oldest first
+	 *
+	 *  @param  out        Output: records
+	 *  @param  maxFrames  Capacity of out
+	 *  @return            Number of records written
+	 */
+	size_t copy(fpsExposureRecord *out, size_t maxFrames) const;
+
+	/** Counter of the newest closed frame, 0 if none */
+	epicsUInt32 frameCount() const { return frame; }
+
+private:
+	void close();
+
+	std::vector<fpsExposureRecord> ring;
+	size_t head;					//next slot to write
+	size_t filled;
+	epicsUInt32 frame;
+
+	//window being integrated
+
+	bool open;
+	fpsUInt64 next;				//expected next sample number
+	fpsExposureRecord current;
+	double m2[FPS_EXP_AXES];
+
+};
+
+#endif
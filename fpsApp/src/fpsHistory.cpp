@@ -0,0 +1,228 @@
+/*Multi-resolution position history for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <math.h>
+#include <epicsMath.h>
+#include <fpsHistory.h>
+
+fpsHistory::fpsHistory():
+	samplePeriod(0),
+	started(false),
+	newest(0)
+{
+	double period = FPS_HIST_PERIOD0;
+	for( int l = 0; l < FPS_HIST_LEVELS; l++ )
+	{
+		levels[l].period = period;
+		levels[l].capacity = 0;
+		levels[l].lastId = -1;
+		levels[l].openId = -1;
+		levels[l].openCount = 0;
+		period *= FPS_HIST_DECADE;
+	}
+}
+
+void fpsHistory::configure(double samplePeriod_, double historySeconds)
+{
+	samplePeriod = samplePeriod_;
+	started = false;
+	newest = 0;
+
+	for( int l = 0; l < FPS_HIST_LEVELS; l++ )
+	{
+		histLevel &lv = levels[l];
+		double buckets = ceil(historySeconds / lv.period);
+		lv.capacity = buckets < 1 ? 1 :
+					  buckets > FPS_HIST_MAX_BUCKETS ? FPS_HIST_MAX_BUCKETS : (size_t) buckets;
+		lv.id.assign(lv.capacity, -1);
+		for( int a = 0; a < FPS_HIST_AXES; a++ )
+		{
+			lv.min[a].assign(lv.capacity, 0);
+			lv.max[a].assign(lv.capacity, 0);
+			lv.mean[a].assign(lv.capacity, 0);
+		}
+		lv.lastId = -1;
+		lv.openId = -1;
+		lv.openCount = 0;
+	}
+}
+
+void fpsHistory::add(fpsUInt64 sample, const double *value)
+{
+	histLevel &lv = levels[0];
+	if( lv.capacity == 0 ) return;
+
+	newest = sample;
+	started = true;
+
+	fpsInt64 id = (fpsInt64) floor(sample * samplePeriod / lv.period);
+
+	if( id != lv.openId )
+	{
+		if( lv.openCount ) closeBucket(0);
+		lv.openId = id;
+	}
+
+	if( lv.openCount == 0 )
+	{
+		for( int a = 0; a < FPS_HIST_AXES; a++ )
+		{
+			lv.openMin[a] = value[a];
+			lv.openMax[a] = value[a];
+			lv.openSum[a] = value[a];
+		}
+	}
+	else
+	{
+		for( int a = 0; a < FPS_HIST_AXES; a++ )
+		{
+			if( value[a] < lv.openMin[a] ) lv.openMin[a] = value[a];
+			if( value[a] > lv.openMax[a] ) lv.openMax[a] = value[a];
+			lv.openSum[a] += value[a];
+		}
+	}
+	lv.openCount++;
+}
+
+//store the open bucket of a level and fold it into the next coarser one
+
+void fpsHistory::closeBucket(int level)
+{
+	histLevel &lv = levels[level];
+	size_t slot = (size_t) (lv.openId % (fpsInt64) lv.capacity);
+
+	lv.id[slot] = lv.openId;
+	for( int a = 0; a < FPS_HIST_AXES; a++ )
+	{
+		lv.min[a][slot] = lv.openMin[a];
+		lv.max[a][slot] = lv.openMax[a];
+		lv.mean[a][slot] = lv.openSum[a] / lv.openCount;
+	}
+	lv.lastId = lv.openId;
+
+	if( level + 1 < FPS_HIST_LEVELS )
+	{
+		histLevel &up = levels[level + 1];
+		fpsInt64 upId = lv.openId / FPS_HIST_DECADE;
+
+		if( upId != up.openId )
+		{
+			if( up.openCount ) closeBucket(level + 1);
+			up.openId = upId;
+		}
+
+		for( int a = 0; a < FPS_HIST_AXES; a++ )
+		{
+			if( up.openCount == 0 || lv.openMin[a] < up.openMin[a] ) up.openMin[a] = lv.openMin[a];
+			if( up.openCount == 0 || lv.openMax[a] > up.openMax[a] ) up.openMax[a] = lv.openMax[a];
+			up.openSum[a] = ( up.openCount ? up.openSum[a] : 0 ) + lv.openSum[a];
+		}
+		up.openCount += lv.openCount;
+	}
+
+	lv.openCount = 0;
+}
+
+size_t fpsHistory::query(int level, double start, double span, int axis,
+						 double *min, double *max, double *mean, double *time,
+						 size_t maxPoints, int *usedLevel) const
+{
+	if( axis < 0 || axis >= FPS_HIST_AXES || maxPoints == 0 ) return 0;
+
+	//pick the finest level that shows the whole span in maxPoints buckets
+
+	if( level < 0 )
+	{
+		level = FPS_HIST_LEVELS - 1;
+		for( int l = 0; l < FPS_HIST_LEVELS; l++ )
+		{
+			if( span > 0 && span / levels[l].period <= maxPoints )
+			{
+				level = l;
+				break;
+			}
+		}
+	}
+	if( level >= FPS_HIST_LEVELS ) level = FPS_HIST_LEVELS - 1;
+	if( usedLevel ) *usedLevel = level;
+
+	const histLevel &lv = levels[level];
+	if( !started || lv.capacity == 0 ) return 0;
+
+	//every level is anchored to the newest sample, not to its own newest
+	//closed bucket, so start and time mean the same on all levels
+
+	double now = newest * samplePeriod;
+	fpsInt64 nowId = (fpsInt64) floor(now / lv.period);
+
+	fpsInt64 count = span > 0 ? (fpsInt64) ceil(span / lv.period) : (fpsInt64) maxPoints;
+	if( count > (fpsInt64) maxPoints ) count = maxPoints;
+
+	fpsInt64 first = (fpsInt64) floor((now - start) / lv.period);
+	if( start <= 0 ) first = nowId + 1 - count;
+	if( first + count > nowId + 1 ) count = nowId + 1 - first;
+	if( count <= 0 ) return 0;
+
+	for( fpsInt64 i = 0; i < count; i++ )
+	{
+		fpsInt64 id = first + i;
+		size_t slot = id < 0 ? 0 : (size_t) (id % (fpsInt64) lv.capacity);
+		time[i] = id * lv.period;
+
+		if( id > lv.lastId )
+		{
+			double sum;
+			epicsUInt32 n = openBucket( level, id, axis, &min[i], &max[i], &sum );
+			if( n )
+			{
+				mean[i] = sum / n;
+				continue;
+			}
+		}
+
+		if( id < 0 || lv.id[slot] != id )
+		{
+			min[i] = max[i] = mean[i] = epicsNAN;
+			continue;
+		}
+
+		min[i] = lv.min[axis][slot];
+		max[i] = lv.max[axis][slot];
+		mean[i] = lv.mean[axis][slot];
+	}
+
+	return (size_t) count;
+}
+
+//buckets newer than the last closed one of a level are not complete yet,
+//their samples are spread over the open buckets of this and all finer levels
+
+epicsUInt32 fpsHistory::openBucket(int level, fpsInt64 id, int axis, double *min, double *max, double *sum) const
+{
+	epicsUInt32 count = 0;
+	fpsInt64 scale = 1;
+
+	for( int l = level; l >= 0; l-- )
+	{
+		const histLevel &lv = levels[l];
+		if( lv.openCount && lv.openId / scale == id )
+		{
+			if( count == 0 || lv.openMin[axis] < *min ) *min = lv.openMin[axis];
+			if( count == 0 || lv.openMax[axis] > *max ) *max = lv.openMax[axis];
+			*sum = ( count ? *sum : 0 ) + lv.openSum[axis];
+			count += lv.openCount;
+		}
+		scale *= FPS_HIST_DECADE;
+	}
+
+	return count;
+}
+
+double fpsHistory::levelPeriod(int level) const
+{
+	if( level < 0 || level >= FPS_HIST_LEVELS ) return 0;
+	return levels[level].period;
+}
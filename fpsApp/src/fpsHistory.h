@@ -0,0 +1,99 @@
+/*Multi-resolution position history for the FPS3010 driver
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Keeps min/max/mean buckets of every axis at 1 ms, 10 ms, 100 ms and 1 s
+resolution. Buckets are built from the position stream in O(1) per sample:
+only the finest level sees the samples, every closed bucket is folded into
+the open bucket of the next coarser level.
+
+*/
+
+#ifndef FPSHISTORY_H
+#define FPSHISTORY_H
+
+#include <vector>
+#include <epicsTypes.h>
+#include <fpsTypes.h>
+
+#define FPS_HIST_AXES		3
+#define FPS_HIST_LEVELS		4
+#define FPS_HIST_DECADE		10			//period ratio of two neighbouring levels
+#define FPS_HIST_PERIOD0	1e-3		//period of the finest level (s)
+#define FPS_HIST_MAX_BUCKETS	(1<<20)	//ring size limit per level, ~17 min at 1 ms
+
+class fpsHistory
+{
+
+public:
+	fpsHistory();
+
+	/** Allocate the rings
+	 *
+	 *  Every level is sized to hold historySeconds, limited to
+	 *  FPS_HIST_MAX_BUCKETS buckets. All previous data are dropped.
+	 *  @param  samplePeriod    Time between two stream samples (s)
+	 *  @param  historySeconds  Time span to keep on every level (s)
+	 */
+	void configure(double samplePeriod, double historySeconds);
+
+	/** Add one sample of all axes
+	 *
+	 *  @param  sample   Monotonic sample number since the stream started
+	 *  @param  value    Positions of axes 1, 2 and 3
+	 */
+	void add(fpsUInt64 sample, const double *value);
+
+	/** Read a time range
+	 *
+	 *  Buckets are returned oldest first. Buckets that are not closed yet on
+	 *  the level, the bucket of the newest sample and on coarse levels the
+	 *  one before, are merged from the open buckets of the finer levels.
+	 *  Buckets that have been lost or overwritten are returned as NaN.
+	 *  @param  level      Resolution level, or -1 to select the finest level
+	 *                     that covers span with maxPoints buckets
+	 *  @param  start      Begin of the range in seconds before the newest
+	 *                     sample, <= 0 for the range ending at the newest sample
+	 *  @param  span       Length of the range (s), <= 0 for maxPoints buckets
+	 *  @param  axis       Axis number (0 ... 2)
+	 *  @param  min,max,mean  Output: bucket statistics, maxPoints elements
+	 *  @param  time       Output: bucket start in stream time, sample number
+	 *                     times sample period (s), the same on every level
+	 *  @param  maxPoints  Capacity of the output arrays
+	 *  @param  usedLevel  Output: level actually read
+	 *  @return            Number of buckets written
+	 */
+	size_t query(int level, double start, double span, int axis,
+				 double *min, double *max, double *mean, double *time,
+				 size_t maxPoints, int *usedLevel) const;
+
+	double levelPeriod(int level) const;
+
+private:
+	struct histLevel
+	{
+		double period;
+		size_t capacity;
+		std::vector<fpsInt64> id;			//bucket number held by each slot
+		std::vector<double> min[FPS_HIST_AXES];
+		std::vector<double> max[FPS_HIST_AXES];
+		std::vector<double> mean[FPS_HIST_AXES];
+		fpsInt64 lastId;					//newest closed bucket, -1 if none
+		fpsInt64 openId;					//bucket currently being filled
+		epicsUInt32 openCount;
+		double openMin[FPS_HIST_AXES];
+		double openMax[FPS_HIST_AXES];
+		double openSum[FPS_HIST_AXES];
+	};
+
+	void closeBucket(int level);
+	epicsUInt32 openBucket(int level, fpsInt64 id, int axis, double *min, double *max, double *sum) const;
+
+	double samplePeriod;
+	bool started;
+	fpsUInt64 newest;					//sample number of the newest sample
+	histLevel levels[FPS_HIST_LEVELS];
+
+};
+
+#endif
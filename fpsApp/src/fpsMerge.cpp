@@ -0,0 +1,703 @@
+/*Time aligned merge of several FPS3010 streams
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Every input keeps a bounded ring of its reconstructed sample times and
+positions. A task resamples all inputs onto a common time base by linear
+interpolation and publishes blocks of FPS_MERGE_BLOCK samples, one
+waveform per combined axis (addr = input * 3 + axis).
+
+Sample times are reconstructed from the sample number and the sample
+period, anchored to the host clock at the first packet. Without markers
+the drift between the device clocks is taken out with a line fitted to
+the packet latency floor of every input: its slope is the clock rate
+error of the input against the host, so a constant rate mismatch leaves
+no steady skew. With useMarker the inputs are aligned on the rising
+edges of a shared DataMarker pulse instead: every edge of input 0 is
+paired with the nearest edge of the other input, closer than half the
+pulse period, so a packet with several pulses does not pair edges of
+different pulses.
+
+*/
+
+#include <iocsh.h>
+#include <asynDriver.h>
+#include <asynPortDriver.h>
+#include <epicsExport.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include <fpsMerge.h>
+#include <fpsParamBatch.h>
+
+using namespace std;
+
+static const char* driverName = "fpsMergeDriver";
+
+#define FPS_MERGE_MAX_INPUTS	4
+#define FPS_MERGE_MAX_PORTS		4
+#define FPS_MERGE_BUFFER		65536		//default samples per input ring
+#define FPS_MERGE_BLOCK			1000		//samples per published block, NELM of the waveforms
+#define FPS_MERGE_EDGE_WINDOW	0.05		//largest skew taken from one marker edge (s)
+#define FPS_MERGE_EDGES			16			//marker edges kept per input
+#define FPS_MERGE_LATENCY_PACKETS	64		//packets per latency floor
+#define FPS_MERGE_RATE_POINTS	256			//latency floors weighted by the rate fit
+#define FPS_MERGE_DIAG_PERIOD	0.2			//diagnostics update (s)
+
+class fpsMerge;
+
+//merge ports, fpsMergeFeed offers every packet to all of them.
+//Ports are added from iocsh while the streams of the blcfps ports
+//already run, the list is guarded by fpsMergeLock.
+
+static fpsMerge* fpsMerges[FPS_MERGE_MAX_PORTS];
+static int fpsMergeCount;
+static epicsMutex *fpsMergeLock;
+static epicsThreadOnceId fpsMergeOnce = EPICS_THREAD_ONCE_INIT;
+
+static void fpsMergeInit(void *)
+{
+
+	fpsMergeLock = new epicsMutex;
+
+}
+
+struct mergeInput
+{
+	unsigned int devNo;
+	double period;
+	bool started;
+	double anchor;					//merge time of sample 0
+	double offset;					//correction offset + rate * t added to the
+	double rate;					//reconstructed times t
+	double skew;					//remaining alignment error, diagnostics only
+
+	//packet latency, its floor follows the device clock drift
+
+	double latencyMin;
+	double latencyMinTime;
+	int latencyPackets;
+	double floorError;				//last floor against the fit in use
+
+	//exponentially weighted line fit of the floor against time
+
+	int fitPoints;
+	double fitMeanT;
+	double fitMeanY;
+	double fitVarT;
+	double fitCovTY;
+
+	//rising marker edges
+
+	bool marker;
+	double edge[FPS_MERGE_EDGES];	//sample times, ring, newest at edgeHead - 1
+	int edgeHead;
+	int edgeCount;
+	bool paired;
+	double pairedRef;				//newest edge of input 0 paired with this input
+	bool aligned;
+
+	//ring of samples, oldest at head
+
+	size_t head;
+	size_t count;
+	vector<double> time;
+	vector<double> pos[3];
+	int dropped;
+};
+
+class fpsMerge : public asynPortDriver
+{
+
+public:
+	fpsMerge(const char* portName, const char* devices, double period, int useMarker, int bufferSamples);
+	void feed( unsigned int devNo, double samplePeriod, fpsUInt64 sample, unsigned int length,
+			   const double * const positions[3], const bln32 * const markers[3] );
+	void mergeTask();
+
+protected:
+	int mergePos1;
+	int mergeTime2;
+	int mergeSkew3;
+	int mergeFill4;
+	int mergeDropped5;
+	int mergeGaps6;
+	int mergeAligned7;
+
+private:
+	double inputTime(const mergeInput &in, size_t i) const;
+	void push(mergeInput &in, double time, const double *value);
+	void pop(mergeInput &in);
+	void fitFloor(mergeInput &in, double time, double floor);
+	double floorModel(const mergeInput &in, double time) const;
+	void markerEdge(int input);
+	void align(int input);
+	bool resample();
+	void publishDiagnostics();
+
+	epicsMutex dataLock;
+	epicsEvent dataEvent;
+	epicsTimeStamp startTime;
+
+	int nInputs;
+	mergeInput inputs[FPS_MERGE_MAX_INPUTS];
+	double period;
+	int useMarker;
+	size_t capacity;
+
+	//output block being filled and the block being published
+
+	bool outStarted;
+	double outTime;
+	int gaps;
+	size_t outCount;
+	vector<double> stageTime;
+	vector<double> stagePos[FPS_MERGE_MAX_INPUTS * 3];
+	vector<double> pubTime;
+	vector<double> pubPos[FPS_MERGE_MAX_INPUTS * 3];
+
+	fpsParamBatch batch;
+
+};
+
+static void mergeTaskC(void *drvPvt)
+{
+
+	fpsMerge *pMerge = (fpsMerge *) drvPvt;
+	pMerge->mergeTask();
+
+}
+
+//the class constructor function
+
+fpsMerge::fpsMerge(const char* portName, const char* devices, double period_, int useMarker_, int bufferSamples):
+	asynPortDriver(portName,				//port name
+		FPS_MERGE_MAX_INPUTS * 3,			//max addrs
+		7, 									//max params
+		asynFloat64Mask | asynInt32Mask | asynFloat64ArrayMask | asynDrvUserMask,	//interfaces to be implement
+		asynFloat64Mask | asynInt32Mask | asynFloat64ArrayMask,						//interrupt
+		ASYN_MULTIDEVICE, 					//if multidevice and if canblock
+		1, 						//autoconnect
+		0,						//default priority
+		0),						//default stack size
+	nInputs(0),
+	period(period_),
+	useMarker(useMarker_),
+	outStarted(false),
+	outTime(0),
+	gaps(0),
+	outCount(0),
+	batch(this, FPS_MERGE_MAX_INPUTS * 3)
+{
+
+	char *end;
+
+	capacity = bufferSamples > 1 ? bufferSamples : FPS_MERGE_BUFFER;
+	epicsTimeGetCurrent( &startTime );
+
+	//device numbers separated by blanks or commas
+
+	while( devices && *devices && nInputs < FPS_MERGE_MAX_INPUTS )
+	{
+		unsigned long devNo = strtoul( devices, &end, 10 );
+		if( end == devices )
+		{
+			devices++;
+			continue;
+		}
+		devices = end;
+
+		mergeInput &in = inputs[nInputs++];
+		in.devNo = devNo;
+		in.period = 0;
+		in.started = false;
+		in.anchor = 0;
+		in.offset = 0;
+		in.rate = 0;
+		in.skew = 0;
+		in.latencyMin = 0;
+		in.latencyMinTime = 0;
+		in.latencyPackets = 0;
+		in.floorError = 0;
+		in.fitPoints = 0;
+		in.fitMeanT = 0;
+		in.fitMeanY = 0;
+		in.fitVarT = 0;
+		in.fitCovTY = 0;
+		in.marker = false;
+		in.edgeHead = 0;
+		in.edgeCount = 0;
+		in.paired = false;
+		in.pairedRef = 0;
+		in.aligned = false;
+		in.head = 0;
+		in.count = 0;
+		in.time.resize( capacity );
+		for( int axis = 0; axis < 3; axis++ )
+			in.pos[axis].resize( capacity );
+		in.dropped = 0;
+	}
+
+	if( nInputs == 0 )
+		cout << driverName << ": " << portName << ": no devices to merge" << endl;
+
+	stageTime.resize( FPS_MERGE_BLOCK );
+	pubTime.resize( FPS_MERGE_BLOCK );
+	for( int addr = 0; addr < nInputs * 3; addr++ )
+	{
+	stagePos[addr].resize( FPS_MERGE_BLOCK );
+	pubPos[addr].resize( FPS_MERGE_BLOCK );
+	}
+
+	createParam("mergePos", asynParamFloat64Array, &mergePos1);
+	createParam("mergeTime", asynParamFloat64Array, &mergeTime2);
+	createParam("mergeSkew", asynParamFloat64, &mergeSkew3);
+	createParam("mergeFill", asynParamFloat64, &mergeFill4);
+	createParam("mergeDropped", asynParamInt32, &mergeDropped5);
+	createParam("mergeGaps", asynParamInt32, &mergeGaps6);
+	createParam("mergeAligned", asynParamInt32, &mergeAligned7);
+
+	publishDiagnostics();
+
+	epicsThreadCreate( "fpsMerge", epicsThreadPriorityMedium,
+					   epicsThreadGetStackSize(epicsThreadStackMedium),
+					   (EPICSTHREADFUNC) mergeTaskC, this );
+
+	epicsThreadOnce( &fpsMergeOnce, fpsMergeInit, 0 );
+	fpsMergeLock->lock();
+	bool added = fpsMergeCount < FPS_MERGE_MAX_PORTS;
+	if( added )
+		fpsMerges[fpsMergeCount++] = this;
+	fpsMergeLock->unlock();
+
+	if( !added )
+		cout << driverName << ": " << portName << ": too many merge ports, no data" << endl;
+
+}
+
+double fpsMerge::inputTime(const mergeInput &in, size_t i) const
+{
+
+	double t = in.time[(in.head + i) % capacity];
+	return t + in.offset + in.rate * t;
+
+}
+
+//append a sample, the oldest one is dropped when the ring is full
+
+void fpsMerge::push(mergeInput &in, double time, const double *value)
+{
+
+	if( in.count == capacity )
+	{
+		pop( in );
+		in.dropped++;
+	}
+
+	size_t slot = (in.head + in.count) % capacity;
+	in.time[slot] = time;
+	for( int axis = 0; axis < 3; axis++ )
+		in.pos[axis][slot] = value[axis];
+	in.count++;
+
+}
+
+void fpsMerge::pop(mergeInput &in)
+{
+
+	in.head = (in.head + 1) % capacity;
+	in.count--;
+
+}
+
+//position packet from the library thread
+
+void fpsMerge::feed( unsigned int devNo, double samplePeriod, fpsUInt64 sample, unsigned int length,
+					 const double * const positions[3], const bln32 * const markers[3] )
+{
+
+	epicsTimeStamp now;
+	double value[3];
+	int input;
+
+	for( input = 0; input < nInputs; input++ )
+		if( inputs[input].devNo == devNo ) break;
+	if( input == nInputs || length == 0 ) return;
+
+	epicsTimeGetCurrent( &now );
+	double arrival = epicsTimeDiffInSeconds( &now, &startTime );
+
+	dataLock.lock();
+
+	mergeInput &in = inputs[input];
+
+	//anchor the sample clock to the arrival of the first packet
+
+	if( !in.started )
+	{
+		in.period = samplePeriod;
+		in.anchor = arrival - (sample + length) * samplePeriod;
+		in.started = true;
+	}
+
+	//the latency floor of a few packets follows the device clock against the host
+
+	double end = in.anchor + (sample + length) * in.period;
+	double latency = arrival - end;
+	if( in.latencyPackets == 0 || latency < in.latencyMin )
+	{
+		in.latencyMin = latency;
+		in.latencyMinTime = end;
+	}
+	if( ++in.latencyPackets == FPS_MERGE_LATENCY_PACKETS )
+	{
+		in.latencyPackets = 0;
+
+		//error of the correction in use, then refit
+
+		in.floorError = in.fitPoints ? in.latencyMin - floorModel( in, in.latencyMinTime ) : 0;
+		fitFloor( in, in.latencyMinTime, in.latencyMin );
+
+		//correction relative to input 0, input 0 is the time base
+
+		if( !useMarker && input > 0 && inputs[0].fitPoints )
+		{
+			mergeInput &ref = inputs[0];
+			double slope = in.fitVarT > 0 ? in.fitCovTY / in.fitVarT : 0;
+			double refSlope = ref.fitVarT > 0 ? ref.fitCovTY / ref.fitVarT : 0;
+			in.rate = slope - refSlope;
+			in.offset = ( in.fitMeanY - slope * in.fitMeanT ) - ( ref.fitMeanY - refSlope * ref.fitMeanT );
+			in.skew = in.floorError - ref.floorError;
+			in.aligned = true;
+		}
+	}
+
+	for( unsigned int i = 0; i < length; i++ )
+	{
+		//stream positions are in pm, the records show nm
+
+		for( int axis = 0; axis < 3; axis++ )
+			value[axis] = positions[axis][i] * 1e-3;
+
+		double time = in.anchor + (sample + i) * in.period;
+		push( in, time, value );
+
+		bool marker = markers && ( markers[0][i] || markers[1][i] || markers[2][i] );
+		if( marker && !in.marker )
+		{
+			in.edge[in.edgeHead] = time;
+			in.edgeHead = (in.edgeHead + 1) % FPS_MERGE_EDGES;
+			if( in.edgeCount < FPS_MERGE_EDGES ) in.edgeCount++;
+			markerEdge( input );
+		}
+		in.marker = marker;
+	}
+
+	dataLock.unlock();
+
+	dataEvent.signal();
+
+}
+
+//exponentially weighted least squares line through the latency floors,
+//exact for the first FPS_MERGE_RATE_POINTS points
+
+void fpsMerge::fitFloor(mergeInput &in, double time, double floor)
+{
+
+	if( in.fitPoints < FPS_MERGE_RATE_POINTS ) in.fitPoints++;
+	double w = 1.0 / in.fitPoints;
+
+	double dt = time - in.fitMeanT;
+	double dy = floor - in.fitMeanY;
+	in.fitMeanT += w * dt;
+	in.fitMeanY += w * dy;
+	in.fitVarT = (1 - w) * ( in.fitVarT + w * dt * dt );
+	in.fitCovTY = (1 - w) * ( in.fitCovTY + w * dt * dy );
+
+}
+
+double fpsMerge::floorModel(const mergeInput &in, double time) const
+{
+
+	double slope = in.fitVarT > 0 ? in.fitCovTY / in.fitVarT : 0;
+	return in.fitMeanY + slope * (time - in.fitMeanT);
+
+}
+
+//pair a new marker edge with the last edge of input 0
+
+void fpsMerge::markerEdge(int input)
+{
+
+	if( !useMarker ) return;
+
+	if( input == 0 )
+	{
+		for( int i = 1; i < nInputs; i++ )
+			align( i );
+	}
+	else
+		align( input );
+
+}
+
+void fpsMerge::align(int input)
+{
+
+	mergeInput &ref = inputs[0];
+	mergeInput &in = inputs[input];
+
+	if( ref.edgeCount == 0 || in.edgeCount == 0 ) return;
+
+	//an edge farther than half the pulse period may belong to another pulse
+
+	double window = FPS_MERGE_EDGE_WINDOW;
+	if( ref.edgeCount > 1 )
+	{
+		double spacing = ref.edge[(ref.edgeHead + FPS_MERGE_EDGES - 1) % FPS_MERGE_EDGES] -
+						 ref.edge[(ref.edgeHead + FPS_MERGE_EDGES - 2) % FPS_MERGE_EDGES];
+		if( spacing / 2 < window ) window = spacing / 2;
+	}
+
+	//reference edges not paired yet, oldest first; the matching edge of the
+	//input may arrive with a later packet, the reference edge then waits
+
+	for( int r = ref.edgeCount; r > 0; r-- )
+	{
+		double refEdge = ref.edge[(ref.edgeHead + FPS_MERGE_EDGES - r) % FPS_MERGE_EDGES];
+		if( in.paired && refEdge <= in.pairedRef ) continue;
+
+		double refTime = refEdge + ref.offset + ref.rate * refEdge;
+		double skew = 0;
+		bool found = false;
+
+		for( int e = 1; e <= in.edgeCount; e++ )
+		{
+			double edge = in.edge[(in.edgeHead + FPS_MERGE_EDGES - e) % FPS_MERGE_EDGES];
+			double d = (edge + in.offset + in.rate * edge) - refTime;
+			if( fabs(d) < window && ( !found || fabs(d) < fabs(skew) ) )
+			{
+				skew = d;
+				found = true;
+			}
+		}
+		if( !found ) continue;
+
+		in.offset -= skew;
+		in.skew = skew;
+		in.aligned = true;
+		in.paired = true;
+		in.pairedRef = refEdge;
+	}
+
+}
+
+//interpolate all inputs onto the output time base until the block is full
+
+bool fpsMerge::resample()
+{
+
+	if( nInputs == 0 ) return false;
+
+	for( int i = 0; i < nInputs; i++ )
+		if( !inputs[i].started || inputs[i].count < 2 ) return false;
+
+	if( !outStarted )
+	{
+		if( period <= 0 )
+		{
+			for( int i = 0; i < nInputs; i++ )
+				if( inputs[i].period > period ) period = inputs[i].period;
+		}
+
+		outTime = inputTime( inputs[0], 0 );
+		for( int i = 1; i < nInputs; i++ )
+			if( inputTime( inputs[i], 0 ) > outTime ) outTime = inputTime( inputs[i], 0 );
+		outStarted = true;
+	}
+
+	while( outCount < FPS_MERGE_BLOCK )
+	{
+		bool gap = false;
+		double late = outTime;
+
+		for( int i = 0; i < nInputs; i++ )
+		{
+			mergeInput &in = inputs[i];
+
+			//keep the last sample at or before the output time
+
+			while( in.count >= 2 && inputTime( in, 1 ) <= outTime )
+				pop( in );
+
+			if( inputTime( in, 0 ) > outTime )
+			{
+				//data lost or dropped, continue where all inputs have data again
+
+				gap = true;
+				if( inputTime( in, 0 ) > late ) late = inputTime( in, 0 );
+			}
+			else if( in.count < 2 )
+				return false;
+		}
+
+		if( gap )
+		{
+			outTime = late;
+			gaps++;
+			continue;
+		}
+
+		for( int i = 0; i < nInputs; i++ )
+		{
+			mergeInput &in = inputs[i];
+			size_t s0 = in.head;
+			size_t s1 = (in.head + 1) % capacity;
+			double t0 = inputTime( in, 0 );
+			double t1 = inputTime( in, 1 );
+			double w = t1 > t0 ? (outTime - t0) / (t1 - t0) : 0;
+
+			for( int axis = 0; axis < 3; axis++ )
+				stagePos[i * 3 + axis][outCount] = in.pos[axis][s0] + w * (in.pos[axis][s1] - in.pos[axis][s0]);
+		}
+
+		stageTime[outCount] = outTime;
+		outCount++;
+		outTime += period;
+	}
+
+	return true;
+
+}
+
+void fpsMerge::publishDiagnostics()
+{
+
+	for( int i = 0; i < nInputs; i++ )
+	{
+	dataLock.lock();
+	double skew = inputs[i].skew;
+	double fill = (double) inputs[i].count / capacity;
+	int dropped = inputs[i].dropped;
+	int aligned = i == 0 || inputs[i].aligned;
+	dataLock.unlock();
+
+	batch.stageDouble( i, mergeSkew3, skew );
+	batch.stageDouble( i, mergeFill4, fill );
+	batch.stageInt( i, mergeDropped5, dropped );
+	batch.stageInt( i, mergeAligned7, aligned );
+	}
+
+	batch.stageInt( 0, mergeGaps6, gaps );
+
+	//unchanged diagnostics cause no callbacks
+
+	batch.flush();
+
+}
+
+//resample and publish, woken by every packet
+
+void fpsMerge::mergeTask()
+{
+
+	epicsTimeStamp lastDiag, now;
+	epicsTimeGetCurrent( &lastDiag );
+
+	for( ;; )
+	{
+		dataEvent.wait( FPS_MERGE_DIAG_PERIOD );
+
+		for( ;; )
+		{
+			dataLock.lock();
+			bool full = resample();
+			if( full )
+			{
+				stageTime.swap( pubTime );
+				for( int addr = 0; addr < nInputs * 3; addr++ )
+					stagePos[addr].swap( pubPos[addr] );
+				outCount = 0;
+			}
+			dataLock.unlock();
+
+			if( !full ) break;
+
+			lock();
+			doCallbacksFloat64Array( &pubTime[0], FPS_MERGE_BLOCK, mergeTime2, 0 );
+			for( int addr = 0; addr < nInputs * 3; addr++ )
+				doCallbacksFloat64Array( &pubPos[addr][0], FPS_MERGE_BLOCK, mergePos1, addr );
+			unlock();
+		}
+
+		epicsTimeGetCurrent( &now );
+		if( epicsTimeDiffInSeconds( &now, &lastDiag ) >= FPS_MERGE_DIAG_PERIOD )
+		{
+			lastDiag = now;
+			lock();
+			publishDiagnostics();
+			unlock();
+		}
+	}
+
+}
+
+void fpsMergeFeed( unsigned int devNo, double samplePeriod, fpsUInt64 sample, unsigned int length,
+				   const double * const positions[3], const bln32 * const markers[3] )
+{
+
+	epicsThreadOnce( &fpsMergeOnce, fpsMergeInit, 0 );
+
+	fpsMergeLock->lock();
+	for( int i = 0; i < fpsMergeCount; i++ )
+		fpsMerges[i]->feed( devNo, samplePeriod, sample, length, positions, markers );
+	fpsMergeLock->unlock();
+
+}
+
+
+//banding to the epics iocsh shell
+
+extern "C" int fpsMergeConfigure(const char* portName, const char* devices, double period,
+								 int useMarker, int bufferSamples)
+{
+
+	new fpsMerge(portName, devices, period, useMarker, bufferSamples);
+	return asynSuccess;
+
+}
+
+static const iocshArg fpsMergeArg0 = {"Port name", iocshArgString};
+static const iocshArg fpsMergeArg1 = {"devices", iocshArgString};
+static const iocshArg fpsMergeArg2 = {"period", iocshArgDouble};
+static const iocshArg fpsMergeArg3 = {"use marker", iocshArgInt};
+static const iocshArg fpsMergeArg4 = {"buffer samples", iocshArgInt};
+static const iocshArg * const fpsMergeArgs[] = {&fpsMergeArg0, &fpsMergeArg1, &fpsMergeArg2,
+												&fpsMergeArg3, &fpsMergeArg4};
+
+static const iocshFuncDef fpsMergeFuncDef = {"fpsMergeConfigure", 5, fpsMergeArgs};
+static void fpsMergeCallFunc(const iocshArgBuf *args)
+{
+
+	fpsMergeConfigure(args[0].sval, args[1].sval, args[2].dval, args[3].ival, args[4].ival);
+
+}
+
+void fpsMergeRegister(void)
+{
+
+	iocshRegister(&fpsMergeFuncDef, fpsMergeCallFunc);
+
+}
+
+extern "C" {
+
+	epicsExportRegistrar(fpsMergeRegister);
+
+}
@@ -0,0 +1,30 @@
+/*Time aligned merge of several FPS3010 streams
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+The blcfps drivers hand every position packet to fpsMergeFeed, the merge
+ports configured with fpsMergeConfigure pick the devices they combine.
+
+*/
+
+#ifndef FPSMERGE_H
+#define FPSMERGE_H
+
+#include <epicsTypes.h>
+#include <fpsTypes.h>
+#include <fps3010.h>
+
+/** Pass a position packet to the merge ports
+ *
+ *  Called from the library thread, never blocks for long.
+ *  @param  devNo         Number of the device that produced the data
+ *  @param  samplePeriod  Time between two samples of the device (s)
+ *  @param  sample        Monotonic sample number of the first position
+ *  @param  length        Number of triples of position values
+ *  @param  positions     Positions [pm] of axes 1, 2 and 3
+ *  @param  markers       Data marker flags, may be empty
+ */
+void fpsMergeFeed( unsigned int devNo, double samplePeriod, fpsUInt64 sample, unsigned int length,
+				   const double * const positions[3], const bln32 * const markers[3] );
+
+#endif
@@ -0,0 +1,163 @@
+/*Batched parameter updates for the FPS3010 drivers
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <math.h>
+#include <epicsMath.h>
+#include <fpsParamBatch.h>
+
+fpsParamBatch::fpsParamBatch(asynPortDriver *driver_, int maxAddr):
+	driver(driver_),
+	staged(0),
+	published(0),
+	suppressed(0),
+	callbacks(0),
+	counterAddr(-1),
+	stagedParam(-1),
+	callbacksParam(-1),
+	suppressedParam(-1),
+	ratioParam(-1),
+	entries(maxAddr),
+	dirtyList(maxAddr)
+{
+}
+
+void fpsParamBatch::setCounterParams(int addr, int staged_, int callbacks_, int suppressed_, int ratio_)
+{
+	if( addr < 0 || addr >= (int) entries.size() ) return;
+
+	batchLock.lock();
+	counterAddr = addr;
+	stagedParam = staged_;
+	callbacksParam = callbacks_;
+	suppressedParam = suppressed_;
+	ratioParam = ratio_;
+	batchLock.unlock();
+}
+
+//entries are created on first use, params are known only after createParam
+
+fpsParamBatch::batchEntry &fpsParamBatch::entry(int addr, int param)
+{
+	std::vector<batchEntry> &list = entries[addr];
+
+	if( param >= (int) list.size() )
+	{
+		batchEntry empty = { false, false, false, 0, 0, 0, 0, 0 };
+		list.resize( param + 1, empty );
+	}
+
+	return list[param];
+}
+
+void fpsParamBatch::stageInt(int addr, int param, int value)
+{
+	if( addr < 0 || addr >= (int) entries.size() || param < 0 ) return;
+
+	batchLock.lock();
+	batchEntry &e = entry(addr, param);
+	if( !e.dirty ) dirtyList[addr].push_back( param );
+	e.dirty = true;
+	e.isDouble = false;
+	e.intValue = value;
+	staged++;
+	batchLock.unlock();
+}
+
+void fpsParamBatch::stageDouble(int addr, int param, double value, double deadband)
+{
+	if( addr < 0 || addr >= (int) entries.size() || param < 0 ) return;
+
+	batchLock.lock();
+	batchEntry &e = entry(addr, param);
+	if( !e.dirty ) dirtyList[addr].push_back( param );
+	e.dirty = true;
+	e.isDouble = true;
+	e.doubleValue = value;
+	e.deadband = deadband;
+	staged++;
+	batchLock.unlock();
+}
+
+int fpsParamBatch::flush()
+{
+	int done = 0;
+	std::vector<bool> changed( entries.size(), false );
+
+	batchLock.lock();
+
+	for( size_t addr = 0; addr < entries.size(); addr++ )
+	{
+		std::vector<int> &dirty = dirtyList[addr];
+
+		for( size_t i = 0; i < dirty.size(); i++ )
+		{
+			batchEntry &e = entries[addr][dirty[i]];
+			e.dirty = false;
+
+			if( e.isDouble )
+			{
+				//NaN compares unequal to everything, two NaN count as unchanged
+
+				bool same = e.valid && ( e.doubleValue == e.lastDouble ||
+						    ( isnan(e.doubleValue) && isnan(e.lastDouble) ) ||
+						    fabs(e.doubleValue - e.lastDouble) <= e.deadband );
+				if( same )
+				{
+					suppressed++;
+					continue;
+				}
+				driver->setDoubleParam( (int) addr, dirty[i], e.doubleValue );
+				e.lastDouble = e.doubleValue;
+			}
+			else
+			{
+				if( e.valid && e.intValue == e.lastInt )
+				{
+					suppressed++;
+					continue;
+				}
+				driver->setIntegerParam( (int) addr, dirty[i], e.intValue );
+				e.lastInt = e.intValue;
+			}
+
+			e.valid = true;
+			published++;
+			changed[addr] = true;
+		}
+
+		dirty.clear();
+
+		if( changed[addr] ) done++;
+	}
+
+	//the counters ride along with a flush that does callbacks anyway, they
+	//are written directly so they neither count nor cause a flush themselves
+
+	if( done && counterAddr >= 0 )
+	{
+		if( !changed[counterAddr] )
+		{
+			changed[counterAddr] = true;
+			done++;
+		}
+		callbacks += done;
+
+		driver->setIntegerParam( counterAddr, stagedParam, (int) staged );
+		driver->setIntegerParam( counterAddr, callbacksParam, (int) callbacks );
+		driver->setIntegerParam( counterAddr, suppressedParam, (int) suppressed );
+		driver->setDoubleParam( counterAddr, ratioParam, (double) staged / callbacks );
+	}
+	else
+		callbacks += done;
+
+	for( size_t addr = 0; addr < entries.size(); addr++ )
+		if( changed[addr] )
+			driver->callParamCallbacks( (int) addr, (int) addr );
+
+	batchLock.unlock();
+
+	return done;
+}
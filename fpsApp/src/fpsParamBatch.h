@@ -0,0 +1,84 @@
+/*Batched parameter updates for the FPS3010 drivers
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Values are staged per address from any thread and written to the
+parameter library by flush(), which the owner calls at its publication
+rate. Only values that changed since the last publication, or moved by
+more than their deadband, are written, and every address gets at most
+one callParamCallbacks per flush. The batch can publish its own counters;
+they are written directly, not staged, so they do not count themselves.
+
+*/
+
+#ifndef FPSPARAMBATCH_H
+#define FPSPARAMBATCH_H
+
+#include <vector>
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <asynPortDriver.h>
+
+class fpsParamBatch
+{
+
+public:
+	fpsParamBatch(asynPortDriver *driver, int maxAddr);
+
+	void stageInt(int addr, int param, int value);
+	void stageDouble(int addr, int param, double value, double deadband = 0);
+
+	/** Publish the counters with every flush that does callbacks
+	 *
+	 *  @param  addr        Address of the counter params
+	 *  @param  staged      Int32 param: stage calls
+	 *  @param  callbacks   Int32 param: callParamCallbacks calls
+	 *  @param  suppressed  Int32 param: staged values equal to the published ones
+	 *  @param  ratio       Float64 param: stage calls per callback
+	 */
+	void setCounterParams(int addr, int staged, int callbacks, int suppressed, int ratio);
+
+	/** Write the staged values and do the callbacks
+	 *
+	 *  Must be called with the driver locked.
+	 *  @return   Number of callParamCallbacks done
+	 */
+	int flush();
+
+private:
+	struct batchEntry
+	{
+		bool dirty;
+		bool valid;					//a value has been published
+		bool isDouble;
+		int intValue;
+		double doubleValue;
+		double deadband;
+		int lastInt;
+		double lastDouble;
+	};
+
+	batchEntry &entry(int addr, int param);
+
+	asynPortDriver *driver;
+	epicsMutex batchLock;
+
+	//counters since start, guarded by batchLock
+
+	epicsUInt32 staged;
+	epicsUInt32 published;
+	epicsUInt32 suppressed;
+	epicsUInt32 callbacks;
+
+	int counterAddr;				//-1 if the counters are not published
+	int stagedParam;
+	int callbacksParam;
+	int suppressedParam;
+	int ratioParam;
+
+	std::vector< std::vector<batchEntry> > entries;
+	std::vector< std::vector<int> > dirtyList;
+
+};
+
+#endif
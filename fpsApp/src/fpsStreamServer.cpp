@@ -0,0 +1,482 @@
+/*TCP stream server for full rate FPS3010 consumers
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsThread.h>
+#include <iostream>
+#include <fpsStreamServer.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace std;
+
+#define FPS_STREAM_POLL		0.01		//select timeout, latency of newly queued data (s)
+
+//little endian serialization of the frame header
+
+static void put16(char *p, epicsUInt16 v)
+{
+	p[0] = (char) v;
+	p[1] = (char) (v >> 8);
+}
+
+static void put32(char *p, epicsUInt32 v)
+{
+	for( int i = 0; i < 4; i++ ) p[i] = (char) (v >> (8 * i));
+}
+
+static void put64(char *p, fpsUInt64 v)
+{
+	for( int i = 0; i < 8; i++ ) p[i] = (char) (v >> (8 * i));
+}
+
+static void putDouble(char *p, double v)
+{
+	fpsUInt64 bits;
+	memcpy( &bits, &v, sizeof(bits) );
+	put64( p, bits );
+}
+
+static void putHeader( char *p, epicsUInt16 type, unsigned int devNo, epicsUInt32 length, fpsUInt64 sample,
+					   const epicsTimeStamp &stamp, double period, epicsUInt32 payload, epicsUInt32 flags )
+{
+	memcpy( p, "FPS1", 4 );
+	put16( p + 4, 1 );
+	put16( p + 6, type );
+	put32( p + 8, devNo );
+	put32( p + 12, length );
+	put64( p + 16, sample );
+	put32( p + 24, stamp.secPastEpoch );
+	put32( p + 28, stamp.nsec );
+	putDouble( p + 32, period );
+	put32( p + 40, payload );
+	put32( p + 44, flags );
+}
+
+static void serverTaskC(void *drvPvt)
+{
+	fpsStreamServer *pServer = (fpsStreamServer *) drvPvt;
+	pServer->serverTask();
+}
+
+fpsStreamServer::fpsStreamServer(unsigned int devNo_, const char *bindAddr, int tcpPort, int policy, int queueFrames_):
+	devNo(devNo_),
+	defaultPolicy(policy),
+	listener(INVALID_SOCKET)
+{
+	queueFrames = queueFrames_ >= 2 ? queueFrames_ : 2;
+	if( defaultPolicy < fpsStreamDropOldest || defaultPolicy > fpsStreamSkip )
+		defaultPolicy = fpsStreamDropOldest;
+
+	memset( &address, 0, sizeof(address) );
+	address.sin_family = AF_INET;
+	address.sin_port = htons( (unsigned short) tcpPort );
+	address.sin_addr.s_addr = htonl( INADDR_ANY );
+	if( bindAddr && *bindAddr && aToIPAddr( bindAddr, (unsigned short) tcpPort, &address ) != 0 )
+		cout << "fpsStreamServer: bad address " << bindAddr << ", listening on all interfaces" << endl;
+
+	for( int i = 0; i < FPS_STREAM_CLIENTS; i++ )
+	{
+		streamClient &c = clients[i];
+		c.sock = INVALID_SOCKET;
+		c.active = false;
+		c.closing = false;
+		c.decimation = 1;
+		c.policy = defaultPolicy;
+		c.slots.resize( queueFrames );
+		c.head = 0;
+		c.count = 0;
+		c.offset = 0;
+		c.gapPending = false;
+		c.gapStart = 0;
+		c.gapSamples = 0;
+		c.commandLength = 0;
+		memset( &c.stat, 0, sizeof(c.stat) );
+	}
+}
+
+bool fpsStreamServer::start()
+{
+	osiSockIoctl_t yes = 1;
+
+	if( osiSockAttach() == 0 ) return false;
+
+	listener = epicsSocketCreate( AF_INET, SOCK_STREAM, 0 );
+	if( listener == INVALID_SOCKET ) return false;
+
+	epicsSocketEnableAddressReuseDuringTimeWaitState( listener );
+
+	if( bind( listener, (struct sockaddr *) &address, sizeof(address) ) != 0 ||
+		listen( listener, FPS_STREAM_CLIENTS ) != 0 ||
+		socket_ioctl( listener, FIONBIO, &yes ) != 0 )
+	{
+		epicsSocketDestroy( listener );
+		listener = INVALID_SOCKET;
+		return false;
+	}
+
+	epicsThreadCreate( "fpsStream", epicsThreadPriorityMedium,
+					   epicsThreadGetStackSize(epicsThreadStackMedium),
+					   (EPICSTHREADFUNC) serverTaskC, this );
+	return true;
+}
+
+//next free frame buffer of a client, the caller checked for room
+
+std::vector<char> &fpsStreamServer::queueSlot(streamClient &c)
+{
+	std::vector<char> &slot = c.slots[(c.head + c.count) % queueFrames];
+	c.count++;
+	return slot;
+}
+
+void fpsStreamServer::queueGap(streamClient &c, const epicsTimeStamp &stamp, double samplePeriod)
+{
+	std::vector<char> &frame = queueSlot( c );
+
+	frame.resize( FPS_STREAM_HEADER );
+	putHeader( &frame[0], 1, devNo, (epicsUInt32) c.gapSamples, c.gapStart, stamp, samplePeriod, 0, 0 );
+	c.gapPending = false;
+	c.gapSamples = 0;
+	c.stat.gaps++;
+}
+
+void fpsStreamServer::queueData( streamClient &c, fpsUInt64 sample, unsigned int length, const double * const positions[3],
+								 const bln32 * const markers[3], double samplePeriod, const epicsTimeStamp &stamp )
+{
+	fpsUInt64 dec = c.decimation;
+	fpsUInt64 first = (sample + dec - 1) / dec * dec;		//first kept sample number
+	epicsUInt32 n = first < sample + length ? (epicsUInt32) ((sample + length - first + dec - 1) / dec) : 0;
+	if( n == 0 ) return;
+
+	epicsUInt32 payload = n * 3 * 8 + ( markers ? n : 0 );
+	std::vector<char> &frame = queueSlot( c );
+	frame.resize( FPS_STREAM_HEADER + payload );
+
+	char *p = &frame[0];
+	putHeader( p, 0, devNo, n, first, stamp, samplePeriod * dec, payload, markers ? 1 : 0 );
+	p += FPS_STREAM_HEADER;
+
+	unsigned int i = (unsigned int) (first - sample);
+	for( epicsUInt32 k = 0; k < n; k++, i += (unsigned int) dec )
+	{
+		for( int axis = 0; axis < 3; axis++, p += 8 )
+			putDouble( p, positions[axis][i] );
+	}
+
+	if( markers )
+	{
+		i = (unsigned int) (first - sample);
+		for( epicsUInt32 k = 0; k < n; k++, i += (unsigned int) dec )
+			*p++ = (char) ( (markers[0][i] ? 1 : 0) | (markers[1][i] ? 2 : 0) | (markers[2][i] ? 4 : 0) );
+	}
+}
+
+void fpsStreamServer::post( fpsUInt64 sample, unsigned int length, const double * const positions[3],
+							const bln32 * const markers[3], double samplePeriod, const epicsTimeStamp &stamp )
+{
+	for( int i = 0; i < FPS_STREAM_CLIENTS; i++ )
+	{
+		streamClient &c = clients[i];
+
+		c.lock.lock();
+
+		if( !c.active || c.closing )
+		{
+			c.lock.unlock();
+			continue;
+		}
+
+		//room for the data frame and a pending gap frame
+
+		size_t need = c.gapPending ? 2 : 1;
+
+		if( c.count + need > queueFrames )
+		{
+			if( c.policy == fpsStreamDropClient )
+			{
+				c.closing = true;
+				c.stat.dropped++;
+				c.lock.unlock();
+				continue;
+			}
+
+			if( c.policy == fpsStreamSkip )
+			{
+				if( !c.gapPending )
+				{
+					c.gapPending = true;
+					c.gapStart = sample;
+				}
+				c.gapSamples += length;
+				c.stat.dropped++;
+				c.lock.unlock();
+				continue;
+			}
+
+			//drop the oldest frame that has not been started yet
+
+			while( c.count + need > queueFrames && c.count > ( c.offset > 0 ? 1u : 0u ) )
+			{
+				if( c.offset > 0 )
+				{
+					size_t next = (c.head + 1) % queueFrames;
+					c.slots[c.head].swap( c.slots[next] );
+					c.head = next;
+				}
+				else
+					c.head = (c.head + 1) % queueFrames;
+				c.count--;
+				c.stat.dropped++;
+			}
+
+			//only a partly sent frame left and no room, lose this packet
+
+			if( c.count + need > queueFrames )
+			{
+				c.stat.dropped++;
+				c.lock.unlock();
+				continue;
+			}
+		}
+
+		if( c.gapPending ) queueGap( c, stamp, samplePeriod );
+		queueData( c, sample, length, positions, markers, samplePeriod, stamp );
+
+		c.lock.unlock();
+	}
+}
+
+void fpsStreamServer::acceptClient()
+{
+	osiSockIoctl_t yes = 1;
+	struct sockaddr_in peer;
+	osiSocklen_t peerLength = sizeof(peer);
+
+	SOCKET sock = epicsSocketAccept( listener, (struct sockaddr *) &peer, &peerLength );
+	if( sock == INVALID_SOCKET ) return;
+
+	for( int i = 0; i < FPS_STREAM_CLIENTS; i++ )
+	{
+		streamClient &c = clients[i];
+		c.lock.lock();
+		if( !c.active )
+		{
+			socket_ioctl( sock, FIONBIO, &yes );
+			c.sock = sock;
+			c.active = true;
+			c.closing = false;
+			c.decimation = 1;
+			c.policy = defaultPolicy;
+			c.head = 0;
+			c.count = 0;
+			c.offset = 0;
+			c.gapPending = false;
+			c.gapSamples = 0;
+			c.commandLength = 0;
+			memset( &c.stat, 0, sizeof(c.stat) );
+			c.stat.connected = true;
+			c.stat.decimation = 1;
+			c.lock.unlock();
+			return;
+		}
+		c.lock.unlock();
+	}
+
+	//no free slot
+
+	epicsSocketDestroy( sock );
+}
+
+void fpsStreamServer::readCommands(streamClient &c)
+{
+	char buf[64];
+
+	int n = recv( c.sock, buf, sizeof(buf), 0 );
+	if( n == 0 || ( n < 0 && SOCKERRNO != SOCK_EWOULDBLOCK && SOCKERRNO != SOCK_EINTR ) )
+	{
+		closeClient( c );
+		return;
+	}
+
+	c.lock.lock();
+
+	for( int i = 0; i < n; i++ )
+	{
+		if( buf[i] != '\n' && buf[i] != '\r' )
+		{
+			if( c.commandLength < sizeof(c.command) - 1 ) c.command[c.commandLength++] = buf[i];
+			continue;
+		}
+
+		c.command[c.commandLength] = 0;
+		c.commandLength = 0;
+
+		if( strncmp( c.command, "decimate ", 9 ) == 0 )
+		{
+			int d = atoi( c.command + 9 );
+			c.decimation = d > 1 ? d : 1;
+			c.stat.decimation = c.decimation;
+		}
+		else if( strcmp( c.command, "policy oldest" ) == 0 ) c.policy = fpsStreamDropOldest;
+		else if( strcmp( c.command, "policy client" ) == 0 ) c.policy = fpsStreamDropClient;
+		else if( strcmp( c.command, "policy skip" ) == 0 ) c.policy = fpsStreamSkip;
+	}
+
+	c.lock.unlock();
+}
+
+//one gathered nonblocking write of the queued frames
+
+void fpsStreamServer::sendQueued(streamClient &c)
+{
+	size_t n = 0;
+	long sent;
+
+	c.lock.lock();
+
+#ifdef _WIN32
+	WSABUF iov[FPS_STREAM_IOV];
+	for( ; n < c.count && n < FPS_STREAM_IOV; n++ )
+	{
+		std::vector<char> &frame = c.slots[(c.head + n) % queueFrames];
+		size_t skip = n == 0 ? c.offset : 0;
+		iov[n].buf = &frame[skip];
+		iov[n].len = (ULONG) (frame.size() - skip);
+	}
+	DWORD bytes = 0;
+	sent = n ? ( WSASend( c.sock, iov, (DWORD) n, &bytes, 0, 0, 0 ) == 0 ? (long) bytes : -1 ) : 0;
+#else
+	struct iovec iov[FPS_STREAM_IOV];
+	for( ; n < c.count && n < FPS_STREAM_IOV; n++ )
+	{
+		std::vector<char> &frame = c.slots[(c.head + n) % queueFrames];
+		size_t skip = n == 0 ? c.offset : 0;
+		iov[n].iov_base = &frame[skip];
+		iov[n].iov_len = frame.size() - skip;
+	}
+	struct msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	sent = n ? (long) sendmsg( c.sock, &msg, MSG_NOSIGNAL ) : 0;
+#endif
+
+	if( sent < 0 )
+	{
+		bool fatal = SOCKERRNO != SOCK_EWOULDBLOCK && SOCKERRNO != SOCK_EINTR;
+		c.lock.unlock();
+		if( fatal ) closeClient( c );
+		return;
+	}
+
+	c.stat.bytes += sent;
+
+	//release the frames that went out completely
+
+	size_t left = (size_t) sent;
+	while( c.count > 0 )
+	{
+		size_t rest = c.slots[c.head].size() - c.offset;
+		if( left < rest )
+		{
+			c.offset += left;
+			break;
+		}
+		left -= rest;
+		c.offset = 0;
+		c.head = (c.head + 1) % queueFrames;
+		c.count--;
+		c.stat.frames++;
+	}
+
+	c.lock.unlock();
+}
+
+void fpsStreamServer::closeClient(streamClient &c)
+{
+	c.lock.lock();
+	if( c.active )
+	{
+		epicsSocketDestroy( c.sock );
+		c.sock = INVALID_SOCKET;
+		c.active = false;
+		c.closing = false;
+		c.count = 0;
+		c.offset = 0;
+		c.stat.connected = false;
+	}
+	c.lock.unlock();
+}
+
+void fpsStreamServer::stats(int slot, fpsStreamStats *out)
+{
+	if( slot < 0 || slot >= FPS_STREAM_CLIENTS ) return;
+
+	streamClient &c = clients[slot];
+	c.lock.lock();
+	*out = c.stat;
+	c.lock.unlock();
+}
+
+//accept, read commands and send queues, never blocks on a client
+
+void fpsStreamServer::serverTask()
+{
+	for( ;; )
+	{
+		fd_set readSet, writeSet;
+		struct timeval timeout;
+		int maxSock = (int) listener;
+
+		FD_ZERO( &readSet );
+		FD_ZERO( &writeSet );
+		FD_SET( listener, &readSet );
+
+		for( int i = 0; i < FPS_STREAM_CLIENTS; i++ )
+		{
+			streamClient &c = clients[i];
+			c.lock.lock();
+			bool closing = c.active && c.closing;
+			if( c.active && !c.closing )
+			{
+				FD_SET( c.sock, &readSet );
+				if( c.count ) FD_SET( c.sock, &writeSet );
+				if( (int) c.sock > maxSock ) maxSock = (int) c.sock;
+			}
+			c.lock.unlock();
+			if( closing ) closeClient( c );
+		}
+
+		timeout.tv_sec = 0;
+		timeout.tv_usec = (long) (FPS_STREAM_POLL * 1e6);
+
+		if( select( maxSock + 1, &readSet, &writeSet, 0, &timeout ) < 0 )
+		{
+			epicsThreadSleep( FPS_STREAM_POLL );
+			continue;
+		}
+
+		if( FD_ISSET( listener, &readSet ) ) acceptClient();
+
+		for( int i = 0; i < FPS_STREAM_CLIENTS; i++ )
+		{
+			streamClient &c = clients[i];
+			if( !c.active || c.sock == INVALID_SOCKET ) continue;
+			if( FD_ISSET( c.sock, &readSet ) ) readCommands( c );
+			if( c.active && FD_ISSET( c.sock, &writeSet ) ) sendQueued( c );
+		}
+	}
+}
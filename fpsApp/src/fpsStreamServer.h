@@ -0,0 +1,150 @@
+/*TCP stream server for full rate FPS3010 consumers
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Every position packet is framed per client and queued in a bounded ring
+of frame buffers; a server task sends the queues with nonblocking
+gathered writes. The library thread only copies into the queues and
+never waits for a client. When a queue is full the client's policy
+decides: drop the oldest queued frame, drop the client, or skip the
+data and send a gap frame once there is room again.
+
+Frame format, all fields little endian:
+
+  offset  size  field
+       0     4  magic "FPS1"
+       4     2  version, 1
+       6     2  type, 0 = data, 1 = gap
+       8     4  devNo
+      12     4  data: samples in the frame, gap: samples skipped
+      16     8  sample number of the first sample (not decimated)
+      24     4  host time of the packet, seconds past the EPICS epoch
+      28     4  nanoseconds
+      32     8  time between two samples of the frame (s), IEEE double
+      40     4  payload bytes
+      44     4  flags, bit 0 = marker bytes present
+      48        payload: samples * 3 doubles (pm, axis 1, 2, 3 of each
+                sample), then one byte per sample with the marker of
+                axis N in bit N if flag bit 0 is set
+
+A client may send text lines to the server:
+  decimate N         send every Nth sample (by sample number)
+  policy oldest|client|skip
+
+*/
+
+#ifndef FPSSTREAMSERVER_H
+#define FPSSTREAMSERVER_H
+
+#include <vector>
+#include <epicsTypes.h>
+#include <fpsTypes.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <osiSock.h>
+#include <fps3010.h>
+
+#define FPS_STREAM_CLIENTS		4
+#define FPS_STREAM_HEADER		48
+#define FPS_STREAM_IOV			16			//frames per gathered write
+
+enum fpsStreamPolicy
+{
+	fpsStreamDropOldest = 0,
+	fpsStreamDropClient = 1,
+	fpsStreamSkip = 2
+};
+
+struct fpsStreamStats
+{
+	bool connected;
+	int decimation;
+	fpsUInt64 bytes;				//bytes sent
+	epicsUInt32 frames;				//frames sent completely
+	epicsUInt32 dropped;			//frames dropped or skipped
+	epicsUInt32 gaps;				//gap frames queued
+};
+
+class fpsStreamServer
+{
+
+public:
+	/** Create the server, nothing is opened before start()
+	 *
+	 *  @param  devNo        Device number written to the frames
+	 *  @param  bindAddr     Local address to listen on, "127.0.0.1" for
+	 *                       local consumers, NULL or "" for all interfaces
+	 *  @param  tcpPort      TCP port
+	 *  @param  policy       Default fpsStreamPolicy of new clients
+	 *  @param  queueFrames  Frames queued per client, at least 2
+	 */
+	fpsStreamServer(unsigned int devNo, const char *bindAddr, int tcpPort, int policy, int queueFrames);
+
+	/** Open the listening socket and start the server task
+	 *
+	 *  @return   false if the socket could not be opened
+	 */
+	bool start();
+
+	/** Queue a position packet for all clients, never blocks on a client
+	 *
+	 *  @param  sample        Monotonic sample number of the first position
+	 *  @param  length        Number of triples of position values
+	 *  @param  positions     Positions [pm] of axes 1, 2 and 3
+	 *  @param  markers       Data marker flags, may be empty
+	 *  @param  samplePeriod  Time between two samples (s)
+	 *  @param  stamp         Host time of the packet
+	 */
+	void post( fpsUInt64 sample, unsigned int length, const double * const positions[3],
+			   const bln32 * const markers[3], double samplePeriod, const epicsTimeStamp &stamp );
+
+	void stats(int slot, fpsStreamStats *out);
+
+	void serverTask();
+
+private:
+	struct streamClient
+	{
+		epicsMutex lock;
+		SOCKET sock;
+		bool active;
+		bool closing;				//dropped by its policy, closed by the server task
+		int decimation;
+		int policy;
+
+		//ring of frame buffers, head frame sent up to offset
+
+		std::vector< std::vector<char> > slots;
+		size_t head;
+		size_t count;
+		size_t offset;
+
+		bool gapPending;
+		fpsUInt64 gapStart;
+		fpsUInt64 gapSamples;
+
+		char command[64];
+		size_t commandLength;
+
+		fpsStreamStats stat;
+	};
+
+	std::vector<char> &queueSlot(streamClient &c);
+	void queueGap(streamClient &c, const epicsTimeStamp &stamp, double samplePeriod);
+	void queueData( streamClient &c, fpsUInt64 sample, unsigned int length, const double * const positions[3],
+					const bln32 * const markers[3], double samplePeriod, const epicsTimeStamp &stamp );
+	void acceptClient();
+	void readCommands(streamClient &c);
+	void sendQueued(streamClient &c);
+	void closeClient(streamClient &c);
+
+	unsigned int devNo;
+	struct sockaddr_in address;
+	int defaultPolicy;
+	size_t queueFrames;
+	SOCKET listener;
+	streamClient clients[FPS_STREAM_CLIENTS];
+
+};
+
+#endif
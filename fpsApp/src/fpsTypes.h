@@ -0,0 +1,21 @@
+/*Integer types shared by the FPS3010 driver modules
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+EPICS base 3.14 has no 64 bit integer types in epicsTypes.h, the sample
+numbers and byte counters of the stream need them.
+
+*/
+
+#ifndef FPSTYPES_H
+#define FPSTYPES_H
+
+#ifdef _MSC_VER
+typedef __int64				fpsInt64;
+typedef unsigned __int64	fpsUInt64;
+#else
+typedef long long			fpsInt64;
+typedef unsigned long long	fpsUInt64;
+#endif
+
+#endif
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Check client for the blcfps TCP stream
+
+Project: SSRF beamline Control Group ioc driver for FPS3010
+
+Connects to a stream started by blcfpsStreamConfigure, decodes the
+48 byte frame headers (format in fpsApp/src/fpsStreamServer.h) and
+checks that the sample numbers of the data and gap frames follow each
+other without a hole. Exits with 1 if a hole, a bad header or a short
+payload was seen.
+
+  fpsStreamCheck.py [-H host] [-p port] [-n frames] [-d N] [-P policy]
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+HEADER = struct.Struct("<4sHHIIQIIdII")		# 48 bytes, little endian
+MAGIC = b"FPS1"
+DATA, GAP = 0, 1
+
+
+def recvAll(sock, size):
+	buf = bytearray()
+	while len(buf) < size:
+		chunk = sock.recv(size - len(buf))
+		if not chunk:
+			raise EOFError("server closed the connection")
+		buf += chunk
+	return bytes(buf)
+
+
+def main():
+	parser = argparse.ArgumentParser(description="check the sample numbers of a blcfps stream")
+	parser.add_argument("-H", "--host", default="127.0.0.1")
+	parser.add_argument("-p", "--port", type=int, default=5100)
+	parser.add_argument("-n", "--frames", type=int, default=1000, help="frames to check, 0 = forever")
+	parser.add_argument("-d", "--decimate", type=int, default=1)
+	parser.add_argument("-P", "--policy", choices=("oldest", "client", "skip"))
+	args = parser.parse_args()
+
+	sock = socket.create_connection((args.host, args.port))
+
+	basePeriod = None		# sample period before decimation, from the first data frame
+	nextSample = None		# first sample number not covered yet
+	dec = 1
+	frames = samples = skipped = holes = errors = 0
+
+	try:
+		while args.frames == 0 or frames < args.frames:
+			(magic, version, kind, devNo, length, first, sec, nsec,
+				period, payload, flags) = HEADER.unpack(recvAll(sock, HEADER.size))
+
+			if magic != MAGIC or version != 1 or kind not in (DATA, GAP):
+				print("bad header: magic %r version %d type %d" % (magic, version, kind))
+				errors += 1
+				break
+
+			body = recvAll(sock, payload)
+			frames += 1
+
+			if kind == GAP:
+				if nextSample is not None and not nextSample <= first < nextSample + dec:
+					print("frame %d: gap starts at %d, expected %d" % (frames, first, nextSample))
+					holes += 1
+				skipped += length
+				nextSample = first + length
+				continue
+
+			expect = length * 24 + (length if flags & 1 else 0)
+			if payload != expect:
+				print("frame %d: %d payload bytes for %d samples, expected %d" % (frames, payload, length, expect))
+				errors += 1
+
+			#the requests are sent after the first frame, which is never decimated
+
+			if basePeriod is None:
+				basePeriod = period
+				if args.decimate > 1:
+					sock.sendall(b"decimate %d\n" % args.decimate)
+				if args.policy:
+					sock.sendall(b"policy %s\n" % args.policy.encode())
+
+			dec = max(1, int(round(period / basePeriod))) if basePeriod > 0 else 1
+
+			#a decimated frame starts at the first multiple of dec in its packet
+
+			if nextSample is not None and not nextSample <= first < nextSample + dec:
+				print("frame %d: first sample %d, expected %d" % (frames, first, nextSample))
+				holes += 1
+
+			samples += length
+			if length:
+				nextSample = first + (length - 1) * dec + 1
+
+			if frames == 1 or frames % 1000 == 0:
+				x = struct.unpack_from("<3d", body) if length else (0, 0, 0)
+				print("dev %d sample %d time %d.%09d period %.3f us: %.0f %.0f %.0f pm"
+					% (devNo, first, sec, nsec, period * 1e6, x[0], x[1], x[2]))
+
+	except EOFError as e:
+		print(e)
+		if args.frames:
+			errors += 1
+	except KeyboardInterrupt:
+		pass
+	finally:
+		sock.close()
+
+	print("%d frames, %d samples, %d skipped in gap frames, %d holes, %d errors"
+		% (frames, samples, skipped, holes, errors))
+	return 1 if holes or errors else 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
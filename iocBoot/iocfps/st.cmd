@@ -16,7 +16,19 @@ fps_registerRecordDeviceDriver pdbbase
 dbLoadTemplate("fpsApp/Db/fps.substitution")
 
 var fpsDebug 1
-blcfpsConfigure("blc",0)
+## port, devNo, lbSmpTime (sample time 2^lbSmpTime * 10.24us, 0 = 10.24us,
+## 5 = 327.68us, -1 = default 5), history seconds per level
+blcfpsConfigure("blc",0,5,3600)
+
+## merge several devices: port, "devNo devNo ...", period (0 = slowest input),
+## align on DataMarker edges, buffer samples per device
+#blcfpsConfigure("blc1",1,5,3600)
+#fpsMergeConfigure("merge","0 1",0,0,65536)
+#dbLoadTemplate("fpsApp/Db/fpsMerge.substitution")
+
+## full rate TCP stream: port, TCP port, bind address ("" = all),
+## policy (0 drop oldest, 1 drop client, 2 skip), frames queued per client
+#blcfpsStreamConfigure("blc",5100,"127.0.0.1",0,256)
 
 cd ${TOP}/iocBoot/${IOC}
 iocInit